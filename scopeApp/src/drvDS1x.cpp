@@ -25,6 +25,7 @@
 #include <iocsh.h>
 
 #include "drvDS1x.h"
+#include "wfConvert.h"
 
 namespace {
 const char *dname="drvDS1x";
@@ -156,6 +157,7 @@ drvDS1x::drvDS1x(const char* port, const char* udp):
     createParam(boDumpStr,        asynParamInt32,        &_boDump);
   
     _firstix=_mbboTrMode;
+    for (int i=0; i<NCHAN; i++) _pre[i].gen = -1;
   
     setStringParam(_siName, dname);
     message("Constructor drvDS1x: success");
@@ -391,70 +393,81 @@ int drvDS1x::_wfPreamble(char* p, int* ln, int* nb,
 void drvDS1x::getWaveform(int ch) {
 /*-----------------------------------------------------------------------------
  * Requests waveform data for channel ch (0..3).  This gets waveform preamble
- * and waveform data.  It gets called from the base class via the virtual
- * function mechanism.
+ * and waveform data.  The preamble is only requested when the cached one is
+ * stale.  It gets called from the base class via the virtual function
+ * mechanism.
  *---------------------------------------------------------------------------*/
     const char* iam = "getWaveform";
     static int ctst = 0;
     int ctstmx = 20;
     asynStatus stat = asynSuccess;
-    int i, chon, len, n = 0, nb, nbyte, yref;
-    double yinc, yorg; word* pwr = _wfraw;
-    //double vdiv;
+    int i, chon, len, n = 0, nb, nbyte, gen;
     char str[32]; 
-    char* pc = _rbuf;
-    byte* pb; word* pw; word wtmp;
     float* pwf = _wfbuf; 
+    WfPre* pc = &_pre[ch];
+    wfScale_t sc;
+    wfFormat_t fmt;
   
+    stageMark();
     getIntegerParam(ch, _boChOn, &chon);
     if (chon) {
-        sprintf(str, WfPreCmnd, ch+1);
-        stat = writeRd(str, _rbuf, DBUF_LEN);
-        if(stat != asynSuccess) return;
-
-        i = _wfPreamble(_rbuf, &len, &nbyte, &yinc, &yorg, &yref);
-        if (i <= 0) return;
+        gen = preambleGen();
+        if (pc->gen != gen) {
+            sprintf(str, WfPreCmnd, ch+1);
+            stat = writeRd(str, _rbuf, DBUF_LEN);
+            if(stat != asynSuccess) return;
+
+            i = _wfPreamble(_rbuf, &pc->len, &pc->nbyte, &pc->yinc, &pc->yorg, &pc->yref);
+            if (i <= 0) {
+                desync();
+                return;
+            }
+            pc->gen = gen;
+            stageTime(enStPre, pc->len);
+        }
+        len = pc->len;
+        nbyte = pc->nbyte;
 
-        stat = writeRd(ixWfTrace, ch+1, _rbuf, DBUF_LEN);
-        if (stat != asynSuccess) return;
-        if (pc[0] != '#') {
-            errlogPrintf("%s::%s first char not '#' in data\n", dname, iam);
+        expectBlock(len*(nbyte + 1));
+        stat = writeRdBlock(ixWfTrace, ch+1, _wfhdr, _wfblk);
+        if (stat != asynSuccess) {
+            errlogPrintf("%s::%s failed to read data block\n", dname, iam);
             return;
         }
+        stageTime(enStXfer, len);
 
-        str[0] = pc[1];
-        str[1] = 0;
-        n = atoi(str);
-        if ((n < 1) || (n > 9)) {
-            errlogPrintf("%s::%s bad second char in data %s\n", dname, iam, str);
+        // :WAV:FORM BYTE (0) or WORD (1, LSB first), ASCII (2) is not decoded
+        if ((nbyte != 0) && (nbyte != 1)) {
+            errlogPrintf("%s::%s unsupported format %d\n", dname, iam, nbyte);
+            pc->gen = -1;
             return;
         }
-        strncpy(str, &pc[2], n); str[n] = 0;
-        nb = atoi(str);
-        if (nb != len) {
-            return;
+        fmt.width = nbyte + 1;
+        fmt.sgn = false;
+        fmt.msb = false;
+
+        nb = _wfblk.size();
+        if (nb != len*fmt.width) {
             errlogPrintf("%s::%s bad length: nb=%d, len=%d\n", dname, iam, nb, len);
+            pc->gen = -1;
+            return;
         }
-        pb = (byte*)(&_rbuf[n+2]);
-        pw = (word*)pb;
         n = WF_LEN;
-        //vdiv = yinc*25;    // because Rigol gives us yscale in V/25
         n = len<n?len:n;
         n = n<0?0:n;
-        for (i=0; i<n; i++,pb++,pw++){
-            if (nbyte == 1) {
-                wtmp = (200 - (*pb));
-            } else wtmp = (*pw);
-            *pwr = wtmp;
-            *pwf = wtmp;
-            pwf++; 
-            pwr++;
+        // Byte data are inverted about 200, raw counts are passed unscaled
+        if (fmt.width == 1) {
+            sc.a = -1.0; sc.b = 200.0; sc.c = 1.0; sc.d = 0.0;
+        } else {
+            sc.a = 1.0; sc.b = 0.0; sc.c = 1.0; sc.d = 0.0;
         }
+        wfConvertBlock(_wfblk.data(), n, &fmt, &sc, _wfraw, _wfbuf);
+        stageTime(enStDecode, n);
         //_printWF(nbyte, len, n, _rbuf);
 
         if (_analize[ch]) {
             _area[ch] = 0.0;
-            for (i=_mix1[ch]; i<=_mix2[ch]; i++) {
+            for (i=MAX(_mix1[ch], 0); i<=MIN(_mix2[ch], n-1); i++) {
                 _area[ch]+=_wfraw[i];
             }
             if (_doPeds[ch]) {
@@ -475,10 +488,13 @@ void drvDS1x::getWaveform(int ch) {
         }
     }
 
+    stageMark();
     doCallbacksFloat32Array(_wfbuf, n, _wfTrace, ch);
+    stageTime(enStCallback, n);
 
     if ((!ch) && (!((ctst++)%ctstmx))) {
         getString(TrigStCmnd, _siTrSta);
+        stageTime(enStTrig);
     }
 }
 
@@ -501,14 +517,14 @@ void drvDS1x::_printWFData() {
 /*-----------------------------------------------------------------------------
  * prints the first 100 data points of a waveform in p.
  *---------------------------------------------------------------------------*/
-    word* pb = _wfraw;
+    float* pb = _wfraw;
     int i, npl = 20, npts = 100;
     printf("%s\n", _wfpre);
     printf("%d %d %d %d %f %f %d %f %f %d\n", _wfprei[0], _wfprei[1], _wfprei[2], 
             _wfprei[3], _wfpref[0], _wfpref[1], _wfprei[4], _wfpref[2], _wfpref[3], 
             _wfprei[5]);
     for (i=0; i<npts; i++,pb++) {
-        printf(" %d", *pb);
+        printf(" %d", (int)*pb);
         if(!((i+1)%npl)) printf("\n");
     }
     printf("\n");
@@ -529,6 +545,31 @@ void drvDS1x::timeDelayStr(int m, int uix) {
 }
 
 
+bool drvDS1x::isRunning() {
+/*-----------------------------------------------------------------------------
+ * This routine is a re-implementation of a virtual in base class.  Returns
+ * false when the trigger status is STOP, true otherwise.
+ *---------------------------------------------------------------------------*/
+    char str[NAME_LEN+1];
+
+    if (getString(TrigStCmnd, _siTrSta) != asynSuccess) return false;
+    callParamCallbacks();
+    if (getStringParam(_siTrSta, sizeof(str), str) != asynSuccess) return false;
+    return strncmp(str, "STOP", 4) != 0;
+}
+
+
+bool drvDS1x::changesPreamble(int ix) {
+/*-----------------------------------------------------------------------------
+ * This routine is a re-implementation of a virtual in base class.  Adds the
+ * timebase, acquisition type, waveform format and auto scale settings.
+ *---------------------------------------------------------------------------*/
+    return drvScope::changesPreamble(ix) || (ix == _loTimDivV) ||
+           (ix == _mbboTimDivU) || (ix == _boTmMode) || (ix == _mbboAcqTp) ||
+           (ix == _mbboWfFmt) || (ix == _boAutoScl);
+}
+
+
 void drvDS1x::getTrigLevl() {
 /*-----------------------------------------------------------------------------
  * Setup slider for the trigger level value.
@@ -50,6 +50,8 @@ public:
     void          restoreConfig();
     void          getChanPos(int addr);
     void          setChanPos(int addr,double v);
+    bool          isRunning();
+    bool          changesPreamble(int ix);
 
 protected:
     int _mbboTrMode, _mbboTrSou,  _mbboTrCpl,   _mbboTrSlo,   _mbboTrSwe,
@@ -64,6 +66,7 @@ protected:
   
     asynStatus putFltCmnds(int ix, int addr, float v);
     asynStatus putIntCmnds(int ix, int addr, int v);
+    bool isAction(int ix) {return (ix == _boAutoScl) || drvScope::isAction(ix);}
     asynStatus getCmnds(int ix, int addr);
     void setTimePerDiv(double v);
     void timeDelayStr(int m, int uix);
@@ -86,8 +89,15 @@ private:
     char   _rbuf[DBUF_LEN];
     char   _wbuf[DBUF_LEN];
     float  _wfbuf[WF_LEN];
-    word   _wfraw[WF_LEN];
+    float  _wfraw[WF_LEN];
+    std::string _wfhdr;         // text preceding the data block
+    std::vector<char> _wfblk;   // waveform data block
     char   _wfpre[WFPRE];
+    struct WfPre {              // cached :WAV:PRE? reply of a channel
+        int    gen;             // preambleGen() when read, -1 when not cached
+        int    len, nbyte, yref;
+        double yinc, yorg;
+    } _pre[NCHAN];
     int    _wfprei[6];
     float  _wfpref[4];
     int    _posInProg;  // when true, positioning by slider.
@@ -23,6 +23,7 @@
 #include <iocsh.h>
 
 #include "drvDS6x.h"
+#include "wfConvert.h"
 
 namespace {
 const char *dname="drvDS6x";
@@ -164,6 +165,7 @@ drvDS6x::drvDS6x(const char* port, const char* udp):
 
   createParam( mbboAcqTpStr,	asynParamInt32,		&_mbboAcqTp);
   _firstix=_mbboTrMode;
+  for( int i=0; i<NCHAN; i++) _pre[i].gen=-1;
 
   setStringParam( _siName,dname);
   message( "Constructor drvDS6x: success");
@@ -367,55 +369,60 @@ int drvDS6x::_wfPreamble( char* p,int* ln,int* nb){
 void drvDS6x::getWaveform( int ch){
 /*-----------------------------------------------------------------------------
  * Requests waveform data for channel ch (0..3).  This gets waveform preamble
- * and waveform data.  It gets called from the base class via the virtual
- * function mechanism.
+ * and waveform data.  The preamble is only requested when the cached one is
+ * stale.  It gets called from the base class via the virtual function
+ * mechanism.
  *---------------------------------------------------------------------------*/
   const char* iam="_getWaveform";
   static int ctst=0; int ctstmx=20;
-  asynStatus stat=asynSuccess; int i,j,chon,len,n=0,nb,nbyte;
-  word* pwr=_wfraw; char str[32]; char* pc=_rbuf;
-  byte* pb; word* pw; word wtmp; float ftmp; float* pwf=_wfbuf; 
+  asynStatus stat=asynSuccess; int i,chon,len,n=0,nb,nbyte,gen;
+  char str[32]; float* pwf=_wfbuf; wfScale_t sc; wfFormat_t fmt;
+  WfPre* pc=&_pre[ch];
 
+  stageMark();
   getIntegerParam( ch,_boChOn,&chon);
   if(chon){
-    sprintf( str,WfPreCmnd,ch+1);
-    stat=writeRd( str,_rbuf,DBUF_LEN);
-    if(stat!=asynSuccess) return;
-    i=_wfPreamble( _rbuf,&len,&nbyte);
-    if(i<=0) return;
-    stat=writeRd( ixWfTrace,ch+1,_rbuf,DBUF_LEN);
-    if(stat!=asynSuccess) return;
-    if(pc[0]!='#'){
-      errlogPrintf( "%s::%s first char not '#' in data\n",dname,iam);
+    gen=preambleGen();
+    if(pc->gen!=gen){
+      sprintf( str,WfPreCmnd,ch+1);
+      stat=writeRd( str,_rbuf,DBUF_LEN);
+      if(stat!=asynSuccess) return;
+      i=_wfPreamble( _rbuf,&pc->len,&pc->nbyte);
+      if(i<=0){ desync(); return;}
+      pc->gen=gen;
+      stageTime( enStPre,pc->len);
+    }
+    len=pc->len; nbyte=pc->nbyte;
+    expectBlock( len*(nbyte+1));
+    stat=writeRdBlock( ixWfTrace,ch+1,_wfhdr,_wfblk);
+    if(stat!=asynSuccess){
+      errlogPrintf( "%s::%s failed to read data block\n",dname,iam);
       return;
     }
-    str[0]=pc[1]; str[1]=0;
-    n=atoi(str);
-    if((n<1)||(n>9)){
-      errlogPrintf( "%s::%s bad second char in data %s\n",dname,iam,str);
+    stageTime( enStXfer,len);
+    // :WAV:FORM BYTE (0) or WORD (1, LSB first)
+    if((nbyte!=0)&&(nbyte!=1)){
+      errlogPrintf( "%s::%s unsupported format %d\n",dname,iam,nbyte);
+      pc->gen=-1;
       return;
     }
-    strncpy( str,&pc[2],n); str[n]=0;
-    nb=atoi(str);
-    if(nb!=len){
-      errlogPrintf( "%s::%s bad length: nb=%d, len=%d\n",dname,iam,nb,len);
+    fmt.width=nbyte+1; fmt.sgn=false; fmt.msb=false;
+    nb=_wfblk.size();
+    if(nb!=len*fmt.width){
+      errlogPrintf( "%s::%s bad length: nb=%d, len=%d\n",dname,iam,nb,len*fmt.width);
+      pc->gen=-1;
     }
-    pb=(byte*)(&_rbuf[n+2]);
-//  _printWF( nbyte,len,n,_rbuf,pb);
-    pw=(word*)pb;
+//  _printWF( nbyte,len,n,_rbuf,(byte*)_wfblk.data());
     n=WF_LEN;
     n=len<n?len:n;
+    n=MIN(n,nb/fmt.width);
     n=n<0?0:n;
-    for( i=j=0; i<n; i++,pb++,pw++){
-      if(nbyte==0) wtmp=(*pb); else wtmp=(*pw);
-      *pwr=wtmp;
-      ftmp=((wtmp*8.0)/255.0)-4.0;
-      *pwf=ftmp;
-      pwf++; pwr++; j++;
-    }
+    sc.a=1.0; sc.b=0.0; sc.c=8.0/255.0; sc.d=-4.0;   // raw counts, scaled to +-4 div
+    wfConvertBlock( _wfblk.data(),n,&fmt,&sc,_wfraw,_wfbuf);
+    stageTime( enStDecode,n);
     if(_analize[ch]){
       _area[ch]=0.0;
-      for( i=_mix1[ch]; i<=_mix2[ch]; i++){
+      for( i=MAX(_mix1[ch],0); i<=MIN(_mix2[ch],n-1); i++){
 	_area[ch]+=_wfraw[i];
       }
       if(_doPeds[ch]){ _doPeds[ch]=0; _pedestal[ch]=_area[ch];}
@@ -429,8 +436,13 @@ void drvDS6x::getWaveform( int ch){
     n=WF_LEN;
     for(i=0; i<WF_LEN; i++,pwf++) *pwf=1000.0;
   }
+  stageMark();
   doCallbacksFloat32Array( _wfbuf,n,_wfTrace,ch);
-  if((!ch)&&(!((ctst++)%ctstmx))) getString( TrigStCmnd,_siTrSta);
+  stageTime( enStCallback,n);
+  if((!ch)&&(!((ctst++)%ctstmx))){
+    getString( TrigStCmnd,_siTrSta);
+    stageTime( enStTrig);
+  }
 }
 
 
@@ -485,6 +497,30 @@ void drvDS6x::timeDelayStr( int m,int uix){
 }
 
 
+bool drvDS6x::isRunning(){
+/*-----------------------------------------------------------------------------
+ * This routine is a re-implementation of a virtual in base class.  Returns
+ * false when the trigger status is STOP, true otherwise.
+ *---------------------------------------------------------------------------*/
+  char str[NAME_LEN+1];
+  if( getString( TrigStCmnd,_siTrSta)!=asynSuccess) return false;
+  callParamCallbacks();
+  if( getStringParam( _siTrSta,sizeof(str),str)!=asynSuccess) return false;
+  return strncmp( str,"STOP",4)!=0;
+}
+
+
+bool drvDS6x::changesPreamble( int ix){
+/*-----------------------------------------------------------------------------
+ * This routine is a re-implementation of a virtual in base class.  Adds the
+ * timebase, acquisition type, waveform format and auto scale settings.
+ *---------------------------------------------------------------------------*/
+  return drvScope::changesPreamble( ix) || ix==_loTimDivV || ix==_mbboTimDivU ||
+	 ix==_mbboTmMode || ix==_mbboTmHMode || ix==_mbboAcqTp || ix==_boWfFmt ||
+	 ix==_boAutoScl;
+}
+
+
 void drvDS6x::getTrigLevl(){
 /*-----------------------------------------------------------------------------
  * Setup slider for the trigger level value.
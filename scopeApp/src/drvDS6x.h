@@ -52,6 +52,8 @@ public:
   void		restoreConfig();
   void		getChanPos( int addr);
   void		setChanPos( int addr,double v);
+  bool		isRunning();
+  bool		changesPreamble( int ix);
 
 protected:
 
@@ -69,6 +71,7 @@ protected:
 
   asynStatus putFltCmnds( int ix,int addr,float v);
   asynStatus putIntCmnds( int ix,int addr,int v);
+  bool isAction( int ix){ return( ix==_boAutoScl || drvScope::isAction( ix));}
   asynStatus getCmnds( int ix,int addr);
   void setTimePerDiv( double v);
   void timeDelayStr( int m,int uix);
@@ -88,9 +91,15 @@ private:
 
   char		_name[NAME_LEN];
   char		_rbuf[DBUF_LEN];
+  std::string	_wfhdr;		// text preceding the data block
+  std::vector<char> _wfblk;	// waveform data block
   char		_wbuf[DBUF_LEN];
   float		_wfbuf[WF_LEN];
-  word		_wfraw[WF_LEN];
+  float		_wfraw[WF_LEN];
+  struct WfPre{			// cached :WAV:PRE? reply of a channel
+    int		gen;		// preambleGen() when read, -1 when not cached
+    int		len,nbyte;
+  }		_pre[NCHAN];
   int		_posInProg;		// when true, positioning by slider.
   int		_initDone;		// set true when initialization is done
   int		_firstix;		// index of first item in this class
@@ -43,6 +43,9 @@ void drvMDO::_initializeParams() {
     ChCplCmnd      = "CH%d:COUP";
     ChSclCmnd      = "CH%d:SCA";
     WfDatCmnd      = "DAT:SOU CH%d; :WAVF?";
+    WfAllCmnd      = "DAT:SOU %s; :WFMO?; :CURV?";
+    WfCurvCmnd     = "DAT:SOU CH%d; :CURV?";
+    WfCurvAllCmnd  = "DAT:SOU %s; :CURV?";
     WfNptCmnd      = "HOR:RECORDL";
     WfWidCmnd      = "DAT:WID";
     WfStrtCmnd     = "DAT:STAR";
@@ -59,6 +62,7 @@ void drvMDO::_initializeParams() {
     TrigSloCmnd    = "TRIG:A:EDGE:SLO";
     AcqStateCmnd   = "ACQ:STATE";
     TrigStaCmnd    = "TRIG:STATE?";
+    AcqNumCmnd     = "ACQ:NUMACQ?";
     RunCmnd        = "ACQ:STATE RUN";
     StopCmnd       = "ACQ:STATE STOP";
     EseCmnd        = "*ESE";
@@ -73,7 +77,7 @@ void drvMDO::_initializeParams() {
     IdnCmnd        = "*IDN?";
     IPAddrCmnd     = "ETHER:IPADD?";
     WfSouCmnd      = "DATA:SOU";
-    InitCmnd       = "*CLS; :DAT:ENC RIB; :HOR:RECORDL 1000; :HEAD OFF; :VERB ON; DAT:WID 1; :DAT:STAR 1; :DAT:STOP 1000; HOR:DEL:MOD 1";
+    InitCmnd       = "*CLS; :DAT:ENC " TEK_NATIVE_ENC "; :HOR:RECORDL 1000; :HEAD OFF; :VERB ON; DAT:WID 1; :DAT:STAR 1; :DAT:STOP 1000; HOR:DEL:MOD 1";
     HeaderCmnd     = "HEAD?";
     GetConfCmnd    = "*LRN?";
     ErrMsgCmnd     = "EVM?";
@@ -154,12 +158,13 @@ void drvMDO::_initializeParams() {
 }
 
 
-int drvMDO::_parseWfPreamble(const char* buf, int* ln, int* nb, double* ym, double* yz, double* yo) {
+int drvMDO::_parseWfPreamble(const char* buf, int* ln, wfFormat_t* pf, double* ym, double* yz, double* yo) {
 /*-----------------------------------------------------------------------------
- * Unpacks the waveform preamble string.  Returns the length (number of chars) in the preamble.
+ * Unpacks the waveform preamble string and the data format of the block that
+ * follows it.  Returns the length (number of chars) in the preamble.
  *---------------------------------------------------------------------------*/
     const std::string functionName = "parseWfPreamble";
-    int preamble_len = 0, num_params = 0, wd = 0;
+    int preamble_len = 0, num_params = 0;
     int nbyt, nbit, wf_len, ptof;
     char enc[20], bfmt[20], bord[20], ids[80], ptfm[20], ptord[20], xunt[20], yunt[20], char1[20], char2[20];
     double xinc, xzr, ymult, yzr, yof, d1, d2, d3;
@@ -187,23 +192,18 @@ int drvMDO::_parseWfPreamble(const char* buf, int* ln, int* nb, double* ym, doub
         }
     }
 
-    // wd is the width of chars in the waveform length, e.g. for 1000, wd = 4
-    if ((num_params = sscanf(&buf[preamble_len], "#%1d", &wd)) != 1) {
-        asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: failed to get width, num_params=%d\n",
-                driverName.c_str(), functionName.c_str(), num_params);
-        return -1;
-    }
-
-    preamble_len += (2 + wd);
-
     //printf("parseWfPreamble: nbyt=%d,nbit=%d,enc=%s,bfmt=%s\n",nbyt,nbit,enc,bfmt);
     //printf("parseWfPreamble: bord=%s,wf_len=%d,ids=%s,ptfm=%s\n",bord,wf_len,ids,ptfm);
     //printf("parseWfPreamble: xinc=%g,ptof=%d,xzr=%g,xunt=%s\n",xinc,ptof,xzr,xunt);
     //printf("parseWfPreamble: ymult=%g,yzr=%g,yof=%g,yunt=%s\n",ymult,yzr,yof,yunt);
-    //printf("parseWfPreamble: preamble_len=%d, wd=%d\n\n", preamble_len, wd);
+
+    if (!_wfFormat(nbyt, enc, bfmt, bord, pf)) {
+        asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: unsupported data format %s;%d;%s;%s\n",
+                driverName.c_str(), functionName.c_str(), enc, nbyt, bfmt, bord);
+        return -1;
+    }
 
     *ln = wf_len;
-    *nb = nbyt;
     *ym = ymult;
     *yz = yzr;
     *yo = yof;
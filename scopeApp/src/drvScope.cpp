@@ -17,17 +17,137 @@
 #include <epicsThread.h>
 #include <errlog.h>
 #include <alarm.h>
+#include <epicsExport.h>
+#include <iocsh.h>
 #include <asynOctetSyncIO.h>
+#include <asynCommonSyncIO.h>
+#include <osiSock.h>
 
 #include "drvScope.h"
+#include "wfConvert.h"
+#include "drvScopeReplay.h"
 
 namespace {
 const std::string driverName = "drvScope";
 
+const char* stageNames[NSTAGES] = {"trigger", "preamble", "transfer", "decode", "callback"};
+
+std::map<std::string, drvScope*> scopes;   // instances by port name, see drvScope::find()
+
 static void pollerThreadC(void* pPvt) {
     drvScope* pdrvScope = (drvScope*)pPvt;
     pdrvScope->pollerThread();
 }
+
+static void procThreadC(void* pPvt) {
+    drvScope* pdrvScope = (drvScope*)pPvt;
+    pdrvScope->procThread();
+}
+
+static double secondsTo(const epicsTimeStamp* t) {
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    return epicsTimeDiffInSeconds(t, &now);
+}
+}
+
+
+epicsTimerNotify::expireStatus scopeWatchdog::expire(const epicsTime&) {
+    if (!_pscope->watchdog()) return expireStatus(noRestart);
+    return expireStatus(restart, WDOG_TICK);
+}
+
+
+scopeQueue::key_t scopeQueue::_key(const msgq_t& msg) {
+    return key_t(msg.type, std::pair<int,int>(msg.ix, msg.addr));
+}
+
+
+int scopeQueue::send(const msgq_t& msg, bool merge, int cls) {
+/*-----------------------------------------------------------------------------
+ * Queues msg in class cls, or replaces the waiting request for the same
+ * parameter and address with it when merge is true.  The newer request goes
+ * to the end of the queue, so that requests are taken in the order of their
+ * last values.  A request that is not merged, e.g. an action, is a barrier:
+ * requests queued after it are not merged with the ones before it.
+ * Returns one of mqsend_e.
+ *---------------------------------------------------------------------------*/
+    std::list<msgq_t>& order = _order[cls];
+    std::map<key_t,pos_t>::iterator it;
+    int status = enMqAdded;
+
+    _lock.lock();
+    if (merge) {
+        it = _pending.find(_key(msg));
+        if (it != _pending.end()) {
+            order.erase(it->second);
+            status = enMqMerged;
+        }
+        order.push_back(msg);
+        _pending[_key(msg)] = --order.end();
+    } else if ((int)(_order[enMqControl].size() + _order[enMqBulk].size()) < _nmax) {
+        order.push_back(msg);
+        _pending.clear();
+    } else {
+        status = enMqFull;
+    }
+    _lock.unlock();
+
+    if (status != enMqFull) _event.signal();
+    return status;
+}
+
+
+bool scopeQueue::_take(msgq_t* msg, int cls) {
+/*-----------------------------------------------------------------------------
+ * Takes the first request of the highest class up to cls, the lock is held.
+ *---------------------------------------------------------------------------*/
+    std::map<key_t,pos_t>::iterator it;
+
+    for (int c=enMqControl; c<=cls; c++) {
+        std::list<msgq_t>& order = _order[c];
+        if (order.empty()) continue;
+        *msg = order.front();
+        it = _pending.find(_key(*msg));
+        if ((it != _pending.end()) && (it->second == order.begin())) _pending.erase(it);
+        order.pop_front();
+        return true;
+    }
+    return false;
+}
+
+
+bool scopeQueue::receive(msgq_t* msg, double tmo, int cls) {
+/*-----------------------------------------------------------------------------
+ * Takes the first request, control before bulk, waiting up to tmo seconds for
+ * one.  With cls enMqControl only control requests are taken.  Returns false
+ * when there is none.
+ *---------------------------------------------------------------------------*/
+    epicsTimeStamp end;
+    double wait;
+
+    epicsTimeGetCurrent(&end);
+    epicsTimeAddSeconds(&end, tmo);
+
+    _lock.lock();
+    while (!_take(msg, cls)) {
+        _lock.unlock();
+        wait = secondsTo(&end);
+        if ((wait <= 0.0) || !_event.wait(wait)) return false;
+        _lock.lock();
+    }
+    _lock.unlock();
+    return true;
+}
+
+
+int scopeQueue::pending() {
+    int n;
+
+    _lock.lock();
+    n = _order[enMqControl].size() + _order[enMqBulk].size();
+    _lock.unlock();
+    return n;
 }
 
 
@@ -42,12 +162,60 @@ drvScope::drvScope(const char* port, const char* udp):
                 _pollT(0.1),
                 _markchan(0),
                 _chSel(0),
+                _mqSent(0),
+                _mqFailed(0),
+                _mqMerged(0),
+                _mqFull(false),
                 _tracemode(0),
                 _rdtraces(1),
                 _posInProg(0),
                 _measEnabled(0),
+                _pipeline(0),
+                _batch(0),
+                _batchFails(0),
+                _adapt(0),
+                _pollTMax(PTMAX_DEF),
+                _pollTCur(0.1),
+                _acqLast(-1),
+                _acqForce(true),
+                _acqIdle(false),
+                _acqNum(-1),
+                _acqRun(true),
+                _wfAcq(-1),
+                _wfGen(-1),
+                _wfStopped(false),
+                _wfSkips(0),
+                _preGen(0),
+                _opcPending(true),
+                _desync(true),
+                _resyncs(0),
+                _writeBehind(false),
+                _bulkSock(INVALID_SOCKET),
+                _bulkRcvBuf(0),
+                _bulkTmo(0.0),
+                _tmoCtl(TMO_CTL),
+                _tmoBulk(TMO_BULK),
+                _linkBps(0.0),
+                _blkTmo(0.0),
+                _blkExpect(0),
+                _blkLast(0),
+                _disconnected(false),
+                _probeWait(PROBE_MIN),
+                _capFile(NULL),
+                _capRecs(0),
+                _wdNotify(this),
+                _wdActive(false),
+                _wdFired(false),
+                _wdTrips(0),
+                _pasynCommon(NULL),
+                _recovMax(0.0),
+                _batching(false),
+                _useSnap(false),
+                _snapGen(-1),
                 _pollCount(0),
-                _timerQueue(&epicsTimerQueueActive::allocate(true)) {
+                _timerQueue(&epicsTimerQueueActive::allocate(true)),
+                _inBulk(false),
+                _preempts(0) {
 /*------------------------------------------------------------------------------
  * Constructor for the drvScope class. Calls constructor for the asynPortDriver
  * base class.
@@ -62,7 +230,14 @@ drvScope::drvScope(const char* port, const char* udp):
         _area[i] = _pedestal[i] = 0.0;
     }
 
+    scopes[port] = this;
+    timingReset();
+    _bulkRetry.secPastEpoch = _bulkRetry.nsec = 0;
+
     status = pasynOctetSyncIO->connect(udp, 0, &pasynUser, 0);
+    if (status == asynSuccess) {
+        pasynCommonSyncIO->connect(udp, 0, &_pasynCommon, 0);
+    }
 
     if (status != asynSuccess) {
         errlogPrintf("%s::%s:connect: failed to connect to port %s\n",
@@ -151,6 +326,17 @@ drvScope::drvScope(const char* port, const char* udp):
     createParam(aiWfPerStr,        asynParamFloat64,       &_aiWfPeriod);
     createParam(aiWfRateStr,       asynParamFloat64,       &_aiWfRate);
     createParam(boMeasEnabledStr,  asynParamInt32,         &_boMeasEnabled);
+    createParam(boPipeStr,         asynParamInt32,         &_boPipe);
+    createParam(boBatchStr,        asynParamInt32,         &_boBatch);
+    createParam(aiRecovMaxStr,     asynParamFloat64,       &_aiRecovMax);
+    createParam(liMQDepthStr,      asynParamInt32,         &_liMsgQD);
+    createParam(liMQMergedStr,     asynParamInt32,         &_liMsgQM);
+    createParam(boAdaptStr,        asynParamInt32,         &_boAdapt);
+    createParam(aoPTMaxStr,        asynParamFloat64,       &_aoPTMax);
+    createParam(aiPTCurStr,        asynParamFloat64,       &_aiPTCur);
+    createParam(biIdleStr,         asynParamInt32,         &_biIdle);
+    createParam(liAcqCntStr,       asynParamInt32,         &_liAcqCnt);
+    createParam(biNewDataStr,      asynParamInt32,         &_biNewData);
 
     _firstix = _boChOn;
 
@@ -158,18 +344,50 @@ drvScope::drvScope(const char* port, const char* udp):
     setIntegerParam(_biState, conn);
     setIntegerParam(_boRdTraces, _rdtraces);
     setIntegerParam(_boMeasEnabled, _measEnabled);
+    setIntegerParam(_boPipe, _pipeline);
+    setIntegerParam(_boBatch, _batch);
     setDoubleParam(_aoPTMO, _pollT);
+    setIntegerParam(_boAdapt, _adapt);
+    setDoubleParam(_aoPTMax, _pollTMax);
+    setDoubleParam(_aiPTCur, _pollT);
+    setIntegerParam(_biIdle, 0);
+    setIntegerParam(_liAcqCnt, _acqNum);
+    setIntegerParam(_biNewData, 0);
+    setDoubleParam(_aiRecovMax, _recovMax);
 
     callParamCallbacks(0);
 
-    _pmq = new epicsMessageQueue(NMSGQ, MSGQNB);
+    _pmq = new scopeQueue(NMSGQ);
+    _ppq = new epicsMessageQueue(NCHAN, sizeof(int));
+    for (int i=0; i<NCHAN; i++) {
+        _wfFree[i].signal();
+    }
 
-    epicsThreadCreate(driverName.c_str(), epicsThreadPriorityHigh,
+    _pollTid = epicsThreadCreate(driverName.c_str(), epicsThreadPriorityHigh,
                     epicsThreadGetStackSize(epicsThreadStackMedium),
                     (EPICSTHREADFUNC)pollerThreadC, this);
 
+    _procTid = epicsThreadCreate((driverName + "Proc").c_str(), epicsThreadPriorityMedium,
+                    epicsThreadGetStackSize(epicsThreadStackMedium),
+                    (EPICSTHREADFUNC)procThreadC, this);
+
     _chPosTimer = &_timerQueue->createTimer();
+    _wdTimer = &_timerQueue->createTimer();
+    _wdTimer->start(_wdNotify, WDOG_TICK);
+
+}
+
 
+drvScope* drvScope::find(const char* port) {
+/*-----------------------------------------------------------------------------
+ * Returns the drvScope of asyn port port, or NULL when there is none.  Used
+ * by the iocsh functions instead of findAsynPortDriver(), which would
+ * return any kind of driver, e.g. that of the I/O port.
+ *---------------------------------------------------------------------------*/
+    std::map<std::string, drvScope*>::iterator it;
+
+    if (!port || ((it = scopes.find(port)) == scopes.end())) return NULL;
+    return it->second;
 }
 
 
@@ -181,7 +399,11 @@ drvScope::~drvScope() {
     const std::string functionName = "~drvScope";    
 
     _chPosTimer->destroy();
+    _wdTimer->destroy();
     _timerQueue->release();
+    _bulkClose();
+    capture(NULL);
+    scopes.erase(portName);
 
     asynPrint(pasynUser, ASYN_TRACE_FLOW,
             "%s::%s: Exiting...\n", driverName.c_str(), functionName.c_str());
@@ -190,19 +412,36 @@ drvScope::~drvScope() {
 
 void drvScope::pollerThread() {
 /*-----------------------------------------------------------------------------
- * This function runs in a separate thread.  It waits for the poll time.
- * Reads a list of registers and it does callbacks to all
- * clients that have registered with registerDevCallback
+ * This function runs in a separate thread.  It waits on the message queue
+ * until the next acquisition is due, so queued writes are handled as soon as
+ * they arrive.  Acquisitions start every poll time, measured from the start
+ * of one to the start of the next, or right away when the previous one took
+ * longer than that.  Reads a list of registers and it does callbacks to all
+ * clients that have registered with registerDevCallback.  Set commands
+ * taken from the queue in a row are written behind, see _writeBehindBegin().
+ * Control requests that come in during trace reads and measurements are run
+ * between transfers, see _preempt().  Traces are read only when the
+ * instrument has acquired since the last read, see _tracesNew().  In
+ * adaptive mode the poll time follows the acquisitions too, see _acqDue().
+ * While the instrument is disconnected it is only probed, see _probe().
+ * The thread holds the port lock, as procThread does while it processes a
+ * trace, so parameters are never written by both at once.  It lets go of
+ * the lock while it waits or does I/O, see _pollUnlock().
  *---------------------------------------------------------------------------*/
     const std::string functionName = "pollerThread"; 
     msgq_t msgq;
-    int status;
+    int depth;
+    bool got;
+    double wait, period;
+    epicsTimeStamp start, now;
 
     // Wait until iocInit is finished
     while (!interruptAccept) {
         epicsThreadSleep(0.2);
     }
 
+    lock();
+
     // Run post-init commands
     afterInit();
 
@@ -210,34 +449,506 @@ void drvScope::pollerThread() {
             "%s::%s: Starting polling loop...\n", driverName.c_str(), functionName.c_str());
 
     // Poll forever
+    epicsTimeGetCurrent(&start);
+    epicsTimeAddSeconds(&start, -_pollT);
     while(1) {
-        status = _pmq->tryReceive(&msgq,sizeof(msgq));
-        if (status == -1) {
-            if (_rdtraces) {
-                _getTraces();
-            }
-            if (_measEnabled) {
-                getMeasurements(_pollCount);
+        if (_wdFired) {
+            _recover();
+            continue;
+        }
+        if (_disconnected) {
+            _probe();
+            continue;
+        }
+        period = _adapt ? _pollTCur : _pollT;
+        epicsTimeGetCurrent(&now);
+        wait = period - epicsTimeDiffInSeconds(&now, &start);
+        unlock();
+        got = _pmq->receive(&msgq, wait);
+        lock();
+        if (!got) {
+            epicsTimeGetCurrent(&now);
+            if (epicsTimeDiffInSeconds(&now, &start) < period) continue;
+            start = now;
+            if (_rdtraces || _measEnabled) {
+                _acqSample();
+                if (_acqDue()) {
+                    if (_rdtraces && _tracesNew()) {
+                        _inBulk = true;
+                        _getTraces(_pipeline);
+                        _inBulk = false;
+                    }
+                    if (_measEnabled) {
+                        _inBulk = true;
+                        _preempt();
+                        getMeasurements(_pollCount);
+                        _inBulk = false;
+                    }
+                }
             }
             _pollCount = (_pollCount >= 99)?0:(_pollCount + 1);
-            epicsThreadSleep(_pollT);
         } else {
-            asynPrint(pasynUser, ASYN_TRACE_FLOW,
-                    "%s::%s: msgq.type=%d, msgq.ix=%d, msgq.addr=%d\n", driverName.c_str(), functionName.c_str(),
-                    msgq.type, msgq.ix, msgq.addr);
-            switch(msgq.type){
-                case enPutInt: putIntCmnds(msgq.ix,msgq.addr,msgq.ival);
-                               break;
-                case enQuery:  getCmnds(msgq.ix,msgq.addr);
-                               break;
-                case enPutFlt: putFltCmnds(msgq.ix,msgq.addr,msgq.fval);
-                               break;
+            _inBulk = (requestClass(msgq.type, msgq.ix) == enMqBulk);
+            _request(&msgq);
+            _inBulk = false;
+            if (requestClass(msgq.type, msgq.ix) == enMqControl) {
+                // A setting may change the traces, read them at the next poll
+                _acqForce = true;
+                _pollTCur = _pollT;
             }
+            // Set commands queued together go out together
+            depth = _pmq->pending();
+            if (!depth) _writeBehindFlush();
+            setIntegerParam(_liMsgQD, depth);
+            callParamCallbacks(0);
         }
     }
 }
 
 
+void drvScope::_request(msgq_t* pm) {
+/*-----------------------------------------------------------------------------
+ * Runs a request taken from the queue.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "_request";
+
+    asynPrint(pasynUser, ASYN_TRACE_FLOW,
+            "%s::%s: msgq.type=%d, msgq.ix=%d, msgq.addr=%d\n", driverName.c_str(), functionName.c_str(),
+            pm->type, pm->ix, pm->addr);
+    if (pm->type == enQuery) {
+        _writeBehindFlush();
+    } else {
+        _writeBehindBegin();
+    }
+    switch(pm->type){
+        case enPutInt: if (changesPreamble(pm->ix)) {
+                           invalidatePreambles();
+                       }
+                       putIntCmnds(pm->ix,pm->addr,pm->ival);
+                       break;
+        case enQuery:  getCmnds(pm->ix,pm->addr);
+                       break;
+        case enPutFlt: invalidatePreambles();
+                       putFltCmnds(pm->ix,pm->addr,pm->fval);
+                       break;
+        case enCommand: invalidatePreambles();
+                       command(pm->sval.c_str());
+                       callParamCallbacks();
+                       break;
+    }
+}
+
+
+bool drvScope::_pollUnlock() {
+/*-----------------------------------------------------------------------------
+ * Called around I/O and waits, which may block.  In the poller thread it
+ * releases the port lock, which that thread holds otherwise, and returns
+ * true; _pollRelock() takes it back.  In other threads it does nothing.
+ *---------------------------------------------------------------------------*/
+    if (epicsThreadGetIdSelf() != _pollTid) return false;
+    unlock();
+    return true;
+}
+
+
+void drvScope::_pollRelock(bool held) {
+    if (held) lock();
+}
+
+
+bool drvScope::_canPreempt() {
+    return _inBulk && !_wdFired && !_disconnected && (epicsThreadGetIdSelf() == _pollTid);
+}
+
+
+void drvScope::_preempt() {
+/*-----------------------------------------------------------------------------
+ * Runs the control requests waiting in the queue.  Called by bulk work
+ * between transfers, and between the chunks of a block read on the bulk
+ * socket, so that a setting does not wait for all traces to be read.  Does
+ * nothing outside bulk work of the poller, or within a request it runs.
+ *---------------------------------------------------------------------------*/
+    msgq_t msgq;
+    int n = 0;
+
+    if (!_canPreempt()) return;
+
+    _inBulk = false;
+    while (_pmq->receive(&msgq, 0.0, enMqControl)) {
+        _request(&msgq);
+        n++;
+    }
+    _inBulk = true;
+
+    if (n) {
+        _writeBehindFlush();
+        _preempts += n;
+        setIntegerParam(_liMsgQD, _pmq->pending());
+        callParamCallbacks(0);
+    }
+}
+
+
+void drvScope::_acqSample() {
+/*-----------------------------------------------------------------------------
+ * Called by the poller at each poll, before the traces are read.  Reads the
+ * acquisition count of the instrument, getAcqCount(), with one short query,
+ * and the run state, and posts the count.  The run state is only asked for
+ * when the driver has no count, or in adaptive mode when the count has not
+ * moved since the last read, as a count that moves shows the instrument
+ * running.  _acqDue() and _tracesNew() use both without asking again.
+ *---------------------------------------------------------------------------*/
+    _acqNum = getAcqCount();
+    if (_acqNum < 0) {
+        _acqRun = isRunning();
+    } else {
+        _acqRun = !_adapt || (_acqNum != _acqLast) || isRunning();
+    }
+    setIntegerParam(_liAcqCnt, _acqNum);
+}
+
+
+bool drvScope::_acqDue() {
+/*-----------------------------------------------------------------------------
+ * Called by the poller at each poll in adaptive mode, returns true when the
+ * traces and measurements are to be read.  They are when the acquisition
+ * count taken by _acqSample() has advanced since the last read, and then the
+ * poll time goes back to the poll time set, the fastest rate.
+ * While it has not, the poll time doubles after each poll up to _pollTMax.
+ * While the instrument is stopped nothing is read and it is only polled
+ * every _pollTMax.  Without an acquisition count only the run state is
+ * checked, and the traces are read once more after a stop.  A control
+ * request sets _acqForce, as a new setting may change the traces.
+ *---------------------------------------------------------------------------*/
+    bool due, stopped;
+    int n;
+
+    if (!_adapt) {
+        _pollTCur = _pollT;
+        return true;
+    }
+
+    if (_disconnected || _wdFired) return false;
+
+    n = _acqNum;
+    if (n >= 0) {
+        due = (n != _acqLast);
+        stopped = !due && !_acqRun;
+        _acqLast = n;
+    } else {
+        stopped = !_acqRun;
+        due = !stopped || !_acqIdle;
+    }
+    if (_disconnected || _wdFired) return false;
+
+    due = due || _acqForce;
+    _acqForce = false;
+    _acqIdle = stopped;
+
+    if (due) {
+        _pollTCur = _pollT;
+    } else if (stopped) {
+        _pollTCur = MAX(_pollTMax, _pollT);
+    } else {
+        _pollTCur = MIN(MAX(2.0*_pollTCur, _pollT), MAX(_pollTMax, _pollT));
+    }
+
+    setDoubleParam(_aiPTCur, _pollTCur);
+    setIntegerParam(_biIdle, stopped);
+    if (!due) setIntegerParam(_biNewData, 0);
+    callParamCallbacks(0);
+    return due;
+}
+
+
+bool drvScope::_tracesNew() {
+/*-----------------------------------------------------------------------------
+ * Called by the poller before it reads the traces, returns false when they
+ * would be the same as the ones already posted: the acquisition count taken
+ * by _acqSample() has not changed, or, without a count, the instrument was
+ * already stopped at the last read, and no setting has been written since.
+ * Stale traces are not read nor posted, so WF_TRACE monitors fire only with
+ * new data.  BI_NEWDATA tells which case it was.  In sync trace mode the
+ * acquisition is restarted at each read, which resets the count, so the
+ * traces are always read.
+ *---------------------------------------------------------------------------*/
+    bool stale;
+    int gen = preambleGen(), tmode;
+
+    if (_disconnected || _wdFired) return false;
+
+    getIntegerParam(_mbboTracMod, &tmode);
+    if (tmode == enTMSync) {
+        stale = false;
+    } else if (_acqNum >= 0) {
+        stale = (_acqNum == _wfAcq);
+    } else {
+        stale = !_acqRun && _wfStopped;
+    }
+    stale = stale && (gen == _wfGen);
+
+    if (stale) {
+        _wfSkips++;
+    } else {
+        _wfAcq = _acqNum;
+        _wfGen = gen;
+        _wfStopped = !_acqRun;
+    }
+    setIntegerParam(_biNewData, !stale);
+    callParamCallbacks(0);
+    return !stale;
+}
+
+
+void drvScope::_probe() {
+/*-----------------------------------------------------------------------------
+ * Called by the poller while the instrument is disconnected.  Waits for the
+ * probe interval, dropping queued requests: they would each wait for their
+ * timeout, and the settings are read back on reconnect anyway.  Then sends
+ * *IDN?, after connecting the asyn port again if _recover() left it
+ * disconnected.  The interval doubles after each probe that fails, up to
+ * PROBE_MAX.  When the instrument answers, it is initialized again as it may
+ * have been power cycled, which reads back all settings, and polling goes
+ * on.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "_probe";
+    asynStatus status = asynSuccess;
+    epicsTimeStamp end, now;
+    msgq_t msgq;
+    size_t nbw, nbr;
+    double wait;
+    int eom, dropped = 0, conn = 1;
+    bool held, got;
+
+    epicsTimeGetCurrent(&end);
+    epicsTimeAddSeconds(&end, _probeWait);
+    while (1) {
+        epicsTimeGetCurrent(&now);
+        wait = epicsTimeDiffInSeconds(&end, &now);
+        if (wait <= 0.0) break;
+        held = _pollUnlock();
+        got = _pmq->receive(&msgq, wait);
+        _pollRelock(held);
+        if (!got) break;
+        dropped++;
+    }
+    if (dropped) {
+        asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: dropped %d request(s)\n",
+                driverName.c_str(), functionName.c_str(), dropped);
+        setIntegerParam(_liMsgQD, _pmq->pending());
+    }
+
+    if (_pasynCommon && (pasynManager->isConnected(_pasynCommon, &conn) == asynSuccess) && !conn) {
+        held = _pollUnlock();
+        pasynCommonSyncIO->connectDevice(_pasynCommon);
+        _pollRelock(held);
+    }
+    _ioFlush();
+    status = _ioWriteRead("*IDN?", 5, _rbuf, DBUF_LEN, _tmoCtl,
+            &nbw, &nbr, &eom);
+    if ((status != asynSuccess) || !nbr) {
+        _probeWait = MIN(2.0*_probeWait, PROBE_MAX);
+        asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: no reply, next probe in %.1f s\n",
+                driverName.c_str(), functionName.c_str(), _probeWait);
+        return;
+    }
+
+    asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: instrument is back\n",
+            driverName.c_str(), functionName.c_str());
+    _probeWait = PROBE_MIN;
+    setConnectedState(true);
+    _desync = true;
+    _opcPending = true;
+    _bulkClose();
+    invalidatePreambles();
+    afterInit();
+}
+
+
+void drvScope::_wdArm(double tmo) {
+/*-----------------------------------------------------------------------------
+ * An exchange with timeout tmo starts.  It is cancelled, see watchdog(),
+ * unless _wdDisarm() is called within tmo plus WDOG_GRACE seconds.  This
+ * only sets the deadline, the watchdog timer runs all the time.
+ *---------------------------------------------------------------------------*/
+    _wdLock.lock();
+    epicsTimeGetCurrent(&_wdStart);
+    _wdDeadline = _wdStart;
+    epicsTimeAddSeconds(&_wdDeadline, tmo + WDOG_GRACE);
+    _wdActive = true;
+    _wdLock.unlock();
+}
+
+
+void drvScope::_wdDisarm() {
+/*-----------------------------------------------------------------------------
+ * The exchange is over.
+ *---------------------------------------------------------------------------*/
+    _wdLock.lock();
+    _wdActive = false;
+    _wdLock.unlock();
+}
+
+
+bool drvScope::watchdog() {
+/*-----------------------------------------------------------------------------
+ * Called from the timer queue thread every WDOG_TICK seconds.  Cancels an
+ * exchange that is still in flight past its deadline.  A blocked read on
+ * the bulk socket is woken by shutting it down.  A syncIO call on the asyn
+ * port can't be interrupted from here, as it holds the port, but no call
+ * is given a timeout past the deadline, see _wdClamp(), so it returns by
+ * then; the rest of the exchange fails at once and the poller goes to
+ * _recover(), which disconnects the port.  Returns true to be called again.
+ *---------------------------------------------------------------------------*/
+    _wdCheck();
+    return true;
+}
+
+
+bool drvScope::_wdCheck() {
+/*-----------------------------------------------------------------------------
+ * Cancels the exchange in flight if it is past its deadline, see watchdog().
+ * Also called after each syncIO call, which may have ended at the deadline
+ * before the next watchdog tick.  Returns true when it did.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "watchdog";
+    bool fire;
+
+    _wdLock.lock();
+    fire = _wdActive && (secondsTo(&_wdDeadline) < 0.0);
+    if (fire) {
+        _wdActive = false;
+        _wdHung = _wdStart;
+        _wdFired = true;
+        _wdTrips++;
+        if (_bulkSock != INVALID_SOCKET) shutdown(_bulkSock, SHUT_RDWR);
+    }
+    _wdLock.unlock();
+
+    if (fire) {
+        asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: exchange hung for %.1f s, cancelled\n",
+                driverName.c_str(), functionName.c_str(), -secondsTo(&_wdHung));
+    }
+    return fire;
+}
+
+
+double drvScope::_wdClamp(double tmo) {
+/*-----------------------------------------------------------------------------
+ * Returns the timeout tmo for a syncIO call, cut to the deadline of the
+ * exchange in flight, so that no call outlives it.
+ *---------------------------------------------------------------------------*/
+    double left;
+
+    _wdLock.lock();
+    if (_wdActive) {
+        left = MAX(secondsTo(&_wdDeadline), 0.0);
+        if ((tmo < 0.0) || (left < tmo)) tmo = left;
+    }
+    _wdLock.unlock();
+    return tmo;
+}
+
+
+void drvScope::_recover() {
+/*-----------------------------------------------------------------------------
+ * Called by the poller after the watchdog cancelled an exchange.  Takes at
+ * most WDOG_RECOVER seconds: disconnects the asyn port and connects it
+ * again, which drops a connection that may still carry the hung reply,
+ * drains the input, clears the status with *CLS and identifies the
+ * instrument again.  Polling goes on when it answers,
+ * else it is taken as disconnected, see _probe().  The time from the start
+ * of the hung exchange to the end of the recovery is kept, the worst in
+ * AI_RECOVMAX.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "_recover";
+    asynStatus status = asynSuccess;
+    epicsTimeStamp end;
+    size_t nbw = 0, nbr = 0, drained = 0;
+    int eom = 0;
+    bool held;
+    double left, dt;
+    char* p;
+    bool ok = false;
+
+    _bulkClose();
+    _wdFired = false;
+    epicsTimeGetCurrent(&end);
+    epicsTimeAddSeconds(&end, WDOG_RECOVER);
+
+    if (_pasynCommon) {
+        held = _pollUnlock();
+        pasynCommonSyncIO->disconnectDevice(_pasynCommon);
+        pasynCommonSyncIO->connectDevice(_pasynCommon);
+        _pollRelock(held);
+    }
+
+    // Drain what is still coming in
+    _ioFlush();
+    while ((_ioRead(_rbuf, DBUF_LEN, WDOG_DRAIN, &nbr, &eom) == asynSuccess) && nbr) {
+        drained += nbr;
+        if (secondsTo(&end) <= WDOG_DRAIN) break;
+    }
+
+    if ((left = secondsTo(&end)) > 0.0) {
+        status = _ioWrite("*CLS", 4, MIN(_tmoCtl, left), &nbw);
+    }
+    if ((status == asynSuccess) && ((left = secondsTo(&end)) > 0.0)) {
+        status = _ioWriteRead("*IDN?", 5, _rbuf, DBUF_LEN, MIN(_tmoCtl, left), &nbw, &nbr, &eom);
+        ok = (status == asynSuccess) && nbr;
+    }
+
+    dt = -secondsTo(&_wdHung);
+    asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: %s after %.2f s, %zu byte(s) drained\n",
+            driverName.c_str(), functionName.c_str(), ok ? "recovered" : "no reply", dt, drained);
+
+    if (ok) {
+        if ((p = strchr(_rbuf, '\n'))) *p = 0;
+        setStringParam(_wfIdn, _rbuf);
+        _desync = false;
+        _opcPending = true;
+        if (_disconnected) {
+            // Gave up on it meanwhile, initialize as in _probe()
+            setConnectedState(true);
+            invalidatePreambles();
+            afterInit();
+        } else {
+            _ioResult(true, functionName.c_str(), status, "*IDN?", nbw, nbr);
+        }
+    } else {
+        _desync = true;
+        if (!_disconnected) setConnectedState(false);
+    }
+
+    if (dt > _recovMax) {
+        _recovMax = dt;
+        setDoubleParam(_aiRecovMax, _recovMax);
+    }
+    callParamCallbacks(0);
+}
+
+
+void drvScope::procThread() {
+/*-----------------------------------------------------------------------------
+ * This function runs in a separate thread.  In pipelined mode the poller
+ * thread only transfers trace data, fetchWaveform(), and queues the channel
+ * number here.  Decoding, integration and callbacks, procWaveform(), run in
+ * this thread while the poller transfers the next channel.  The channel's
+ * trace buffer is released once it has been processed.
+ *---------------------------------------------------------------------------*/
+    int ch;
+
+    while (1) {
+        _ppq->receive(&ch, sizeof(ch));
+        if ((ch < 0) || (ch >= NCHAN)) continue;
+        lock();
+        procWaveform(ch);
+        unlock();
+        _wfFree[ch].signal();
+    }
+}
+
+
 void drvScope::_evMessage() {
 /*-----------------------------------------------------------------------------
  * Gets next event message from the instrument and posts it in a db record.
@@ -278,9 +989,13 @@ void drvScope::message(const std::string msg) {
 }
 
 
-void drvScope::putInMessgQ(int tp, int ix, int addr, int iv, float fv) {
+void drvScope::putInMessgQ(int tp, int ix, int addr, int iv, float fv, const char* sv) {
 /*-----------------------------------------------------------------------------
- * Construct a message and put in the message queue.
+ * Construct a message and put in the message queue.  A set value or query
+ * replaces the one for the same parameter and address still in the queue,
+ * e.g. while a slider is dragged, so it is never dropped.  Actions and
+ * commands are queued as they come, see isAction().  All exchanges with the
+ * instrument go through the queue, so that only the poller thread does I/O.
  *---------------------------------------------------------------------------*/
     const std::string functionName = "putInMessgQ";
     int status; 
@@ -294,21 +1009,59 @@ void drvScope::putInMessgQ(int tp, int ix, int addr, int iv, float fv) {
     messg.addr = addr;
     messg.ival = iv;
     messg.fval = fv;
+    if (sv) messg.sval = sv;
 
-    status = _pmq->trySend(&messg, sizeof(messg));
+    status = _pmq->send(messg, ((tp == enPutInt) && !isAction(ix)) || (tp == enPutFlt) ||
+            (tp == enQuery), requestClass(tp, ix));
 
-    if (!status) {
+    if (status != enMqFull) {
         _mqSent++;
+        if (status == enMqMerged) _mqMerged++;
     } else {
+        // A hung instrument fills the queue, say so once
+        if (!_mqFull) {
+            asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: queue full, dropping requests\n",
+                    driverName.c_str(), functionName.c_str());
+        }
         _mqFailed++;
     }
+    _mqFull = (status == enMqFull);
 
     setIntegerParam(_liMsgQS, _mqSent);
     setIntegerParam(_liMsgQF, _mqFailed);
+    setIntegerParam(_liMsgQM, _mqMerged);
+    setIntegerParam(_liMsgQD, _pmq->pending());
     callParamCallbacks(0);
 }
 
 
+bool drvScope::isAction(int ix) {
+/*-----------------------------------------------------------------------------
+ * Returns true for an integer parameter whose write triggers an action
+ * rather than sets a value, e.g. a save that is written 1 and then 0.  These
+ * are never merged in the queue.  Drivers with actions of their own add
+ * them.
+ *---------------------------------------------------------------------------*/
+    return (ix == _boUpdt) || (ix == _boErUpdt) || (ix == _boSave) ||
+           (ix == _boRestore) || (ix == _boGetWf) || (ix == _boRun) ||
+           (ix == _boStop) || (ix == _boReset) || (ix == _boInit) ||
+           (ix == _boCls) || (ix == _boAPed) || (ix == _boChSel) ||
+           (ix == _boEvMsg) || (ix == _boGetWfA);
+}
+
+
+int drvScope::requestClass(int type, int ix) {
+/*-----------------------------------------------------------------------------
+ * Returns the class of a request, one of mqclass_e.  Updates, waveform
+ * reads and measurements are bulk work, settings, queries, commands and
+ * other actions are control.
+ *---------------------------------------------------------------------------*/
+    if ((type == enPutInt) && ((ix == _boUpdt) || (ix == _boGetWf) || (ix == _boGetWfA) ||
+            (ix == _boMeasEnabled))) return enMqBulk;
+    return enMqControl;
+}
+
+
 asynStatus drvScope::writeRd(int cix, int ch, char* buf, int blen) {
 /*-----------------------------------------------------------------------------
  * A protected write-read function that can be called from specific class.
@@ -346,62 +1099,857 @@ asynStatus drvScope::_write(const char* pw, size_t nw) {
     asynStatus status = asynSuccess;
     size_t nbw;
 
-    pasynOctetSyncIO->flush(pasynUser);
-    status = pasynOctetSyncIO->write(pasynUser, pw, nw, 1, &nbw);
+    if (_disconnected) return asynDisconnected;
+
+    if (_writeBehind && (_wbCmnds.size() + nw + 2 <= QBATCH_LEN)) {
+        _joinCmnd(_wbCmnds, pw, nw);
+        _opcPending = true;
+        return status;
+    }
+    pw = _withPending(pw, &nw);
+
+    if (_desync && !_resync()) return asynError;
+    _wdArm(_tmoCtl);
+    status = _ioWrite(pw, nw, _tmoCtl, &nbw);
+    _wdDisarm();
     asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: status=%d, pw=%s\n",
             driverName.c_str(), functionName.c_str(), status, pw);
+    _opcPending = true;
     if (status) {
+        _desync = true;
         // Print an error message if this is the first error        
         if (!_err_count) {
             asynPrint(pasynUser, ASYN_TRACE_ERROR,
               "%s::%s: ERROR: status=%d, pw=%s, nbw=%zu\n",
               driverName.c_str(), functionName.c_str(), status, pw, nbw);
         }
-        _err_count++;
+        _err_count++;
+    }
+    return status;
+}
+
+
+void drvScope::_writeBehindBegin() {
+/*-----------------------------------------------------------------------------
+ * Starts holding back writes: _write() joins set commands into _wbCmnds
+ * and read-backs are batched, see batchBegin().  The next exchange with a
+ * reply sends the held commands in front of its query, _writeBehindFlush()
+ * sends what is left.  Only for drivers that take compound commands,
+ * canBatch().
+ *---------------------------------------------------------------------------*/
+    if (_writeBehind || !canBatch()) return;
+
+    _writeBehind = true;
+    _batchQ.clear();
+    _batching = true;
+}
+
+
+asynStatus drvScope::_writeBehindFlush() {
+/*-----------------------------------------------------------------------------
+ * Ends write-behind.  The deferred read-backs go out as compound queries
+ * behind the held commands, in the same exchange, or the commands alone
+ * when there is nothing to read back.  The held commands returned success
+ * when they were queued, so a failure to send them is reported here, as an
+ * error and in the message PV, and the next exchange resyncs.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "_writeBehindFlush";
+    asynStatus status = asynSuccess;
+    std::string held(_wbCmnds), cmnds;
+    bool readback;
+
+    if (!_writeBehind) return status;
+
+    _writeBehind = false;
+    readback = !_batchQ.empty();
+    status = batchFlush();
+
+    if (!_wbCmnds.empty()) {
+        cmnds.swap(_wbCmnds);
+        if (_write(cmnds.c_str(), cmnds.size()) != asynSuccess) status = asynError;
+    }
+
+    if ((status != asynSuccess) && !held.empty()) {
+        asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: ERROR: status=%d, held=%s\n",
+                driverName.c_str(), functionName.c_str(), status, held.c_str());
+        message("Failed to send settings: " + held);
+        _desync = true;
+    }
+
+    if (readback) {
+        getTrigLevl();
+        for (int i=0; i<NCHAN; i++) {
+            callParamCallbacks(i);
+        }
+    }
+
+    return status;
+}
+
+
+void drvScope::_joinCmnd(std::string& msg, const char* pw, size_t nw) {
+/*-----------------------------------------------------------------------------
+ * Appends command pw to the program message msg, ";:" separated so that it
+ * starts from the root of the command tree.
+ *---------------------------------------------------------------------------*/
+    if (!msg.empty()) {
+        msg += ";";
+        if ((pw[0] != ':') && (pw[0] != '*')) {
+            msg += ":";
+        }
+    }
+    msg.append(pw, nw);
+}
+
+
+const char* drvScope::_withPending(const char* pw, size_t* nw) {
+/*-----------------------------------------------------------------------------
+ * Returns pw with the commands held by write-behind in front of it.
+ *---------------------------------------------------------------------------*/
+    if (_wbCmnds.empty()) return pw;
+
+    _wbMsg.swap(_wbCmnds);
+    _wbCmnds.clear();
+    _joinCmnd(_wbMsg, pw, *nw);
+    *nw = _wbMsg.size();
+    return _wbMsg.c_str();
+}
+
+
+asynStatus drvScope::_wtrd(const char* pw, size_t nw, char* pr, size_t nr, double tmo) {
+/*-----------------------------------------------------------------------------
+ * Here we perform an "atomic" write and read operation sequence.  Parameters:
+ *  pw  buffer that has data to be written,
+ *  nw  number of bytes of data in pwb,
+ *  pr  buffer into which data will be read in,
+ *  nr  size of read buffer in bytes,
+ *  tmo timeout, 0 for the control timeout.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "_wtrd";
+    asynStatus status = asynSuccess;
+    int eom;
+    size_t nbw, nbr;
+
+    if (_disconnected) return asynDisconnected;
+
+    pw = _withPending(pw, &nw);
+    if (_desync && !_resync()) return asynError;
+    if (tmo <= 0.0) tmo = _tmoCtl;
+    _wdArm(tmo);
+    status = _ioWriteRead(pw, nw, pr, nr, tmo, &nbw, &nbr, &eom);
+    _wdDisarm();
+
+    asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: status=%d, pw=%s\n",
+            driverName.c_str(), functionName.c_str(), status, pw);
+
+    // A reply that fills the buffer has more to come
+    if ((status == asynSuccess) && (nbr >= nr)) _desync = true;
+
+    if ((status != asynSuccess) || !nbr) _desync = true;
+    _ioResult((status == asynSuccess) && nbr && (nbr <= nr),
+            functionName.c_str(), status, pw, nbw, nbr);
+
+    return status;
+}
+
+
+void drvScope::_ioResult(bool ok, const char* fn, asynStatus status, const char* pw,
+        size_t nbw, size_t nbr) {
+/*-----------------------------------------------------------------------------
+ * Keeps count of failed write-read exchanges.  Allows 5 errors, then sets the
+ * disconnected state, which is cleared by the next good exchange.
+ *---------------------------------------------------------------------------*/
+    if (!ok) {
+        if (_err_count < 5) {
+            asynPrint(pasynUser, ASYN_TRACE_ERROR,
+                    "%s::%s: ERROR: status=%d, pw=%s, nbw=%zu, nbr=%zu\n",
+                    driverName.c_str(), fn, status, pw, nbw, nbr);
+        } else if (_err_count == 5) {
+            setConnectedState(false);
+        }
+        _err_count++;
+    } else {
+        if (_err_count) {
+            setConnectedState(true);
+        }
+    }
+}
+
+
+void drvScope::desync() {
+/*-----------------------------------------------------------------------------
+ * A protected function for drivers to report a reply that did not parse, so
+ * that the next exchange starts with _resync().
+ *---------------------------------------------------------------------------*/
+    _desync = true;
+}
+
+
+bool drvScope::_resync() {
+/*-----------------------------------------------------------------------------
+ * Brings replies back in step with queries after a timeout, an overflow or
+ * a reply that did not parse.  Drops what has arrived, clears the status and
+ * reads until the reply to a marker, so that a late reply to an earlier
+ * query is not taken for the reply to the next one.  The marker sets the
+ * event status enable register to a value that changes at each resync, reads
+ * it back and restores LO_ESE, as a bare "1" from *OPC? or a boolean query
+ * could be a late reply too.  Exchanges in step need no flush, which leaves
+ * the link free for pipelined replies.  Each read is checked on its own:
+ * asyn strips the terminator, so stale replies and the marker would run
+ * together if they were joined.
+ * Returns false, and counts an error, when no marker reply came back.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "_resync";
+    asynStatus status = asynSuccess;
+    size_t nbw = 0, nbr = 0, nbt = 0, n;
+    int eom = 0, ese = 0, mark;
+    char cmnd[48], val[8];
+    std::string reply;
+
+    _desync = false;
+    _resyncs++;
+    asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: resync %d\n",
+            driverName.c_str(), functionName.c_str(), _resyncs);
+
+    // The marker is 1..255 and never the ESE value restored after it
+    getIntegerParam(_loEse, &ese);
+    ese &= 0xff;
+    mark = _resyncs%255 + 1;
+    if (mark == ese) mark = mark%255 + 1;
+    sprintf(val, "%d", mark);
+    sprintf(cmnd, "*ESE %d;*ESE?;*ESE %d", mark, ese);
+
+    _ioFlush();
+    _wdArm(_tmoCtl*(RESYNC_READS + 1));
+    status = _ioWrite("*CLS", 4, _tmoCtl, &nbw);
+    if (status == asynSuccess) {
+        status = _ioWriteRead(cmnd, strlen(cmnd), _rbuf, DBUF_LEN, _tmoCtl,
+                &nbw, &nbr, &eom);
+    }
+    for (int i=0; (status == asynSuccess) && (i < RESYNC_READS); i++) {
+        reply.assign(_rbuf, nbr);
+        nbt += nbr;
+        while (!reply.empty() && ((reply[reply.size()-1] == '\n') || (reply[reply.size()-1] == '\r'))) {
+            reply.erase(reply.size()-1);
+        }
+        n = reply.find_last_of("\n ");
+        if (n != std::string::npos) reply.erase(0, n + 1);
+        if (reply == val) {
+            _wdDisarm();
+            return true;
+        }
+        status = _ioRead(_rbuf, DBUF_LEN, _tmoCtl, &nbr, &eom);
+    }
+    _wdDisarm();
+
+    _desync = true;
+    _ioResult(false, functionName.c_str(), status, cmnd, nbw, nbt);
+    return false;
+}
+
+
+asynStatus drvScope::_wtrdText(const char* pw, size_t nw, std::string& reply) {
+/*-----------------------------------------------------------------------------
+ * Writes a query and reads a text reply of any length: reads go on while
+ * they fill _rbuf, i.e. end by count rather than by terminator or end.
+ *  pw     buffer that has data to be written,
+ *  nw     number of bytes of data in pw,
+ *  reply  returns the reply without the terminator.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "_wtrdText";
+    asynStatus status = asynSuccess;
+    size_t nbw = 0, nbr = 0;
+    int eom = 0;
+
+    reply.clear();
+    if (_disconnected) return asynDisconnected;
+
+    pw = _withPending(pw, &nw);
+    if (_desync && !_resync()) return asynError;
+    _wdArm(_tmoBulk);
+    status = _ioWriteRead(pw, nw, _rbuf, DBUF_LEN, _tmoBulk,
+            &nbw, &nbr, &eom);
+    while (status == asynSuccess) {
+        reply.append(_rbuf, nbr);
+        if (!nbr || (eom & (ASYN_EOM_EOS | ASYN_EOM_END)) || !(eom & ASYN_EOM_CNT)) break;
+        status = _ioRead(_rbuf, DBUF_LEN, _tmoBulk, &nbr, &eom);
+    }
+    _wdDisarm();
+    while (!reply.empty() && ((reply[reply.size()-1] == '\n') || (reply[reply.size()-1] == '\r'))) {
+        reply.erase(reply.size()-1);
+    }
+
+    asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: status=%d, pw=%s, nbr=%zu\n",
+            driverName.c_str(), functionName.c_str(), status, pw, reply.size());
+
+    if ((status != asynSuccess) || reply.empty()) _desync = true;
+    _ioResult((status == asynSuccess) && !reply.empty(), functionName.c_str(), status, pw,
+            nbw, reply.size());
+
+    return status;
+}
+
+
+asynStatus drvScope::writeRdBlock(int cix, int ch, std::string& pre, std::vector<char>& blk) {
+/*-----------------------------------------------------------------------------
+ * A protected write-read function for replies that end in an IEEE-488.2
+ * definite length block, "#N<len><data>".  cix is an index to list of
+ * commands and ch is {1,2,3,4}.  Any text before the block is returned in pre,
+ * the block data in blk, which is resized to the block length.
+ *---------------------------------------------------------------------------*/
+    const char* pcmd = getCommand(cix);
+    char cmnd[64];
+
+    if (!pcmd) return asynError;
+
+    sprintf(cmnd, pcmd, ch);
+
+    return writeRdBlock(cmnd, pre, blk);
+}
+
+
+asynStatus drvScope::writeRdBlock(const char* cmnd, std::string& pre, std::vector<char>& blk) {
+/*-----------------------------------------------------------------------------
+ * As above, for a command string cmnd.
+ *---------------------------------------------------------------------------*/
+    std::vector<char>* pblk = &blk;
+
+    return _wtrdBlock(cmnd, strlen(cmnd), pre, &pblk, 1);
+}
+
+
+asynStatus drvScope::writeRdBlocks(const char* cmnd, std::string& pre,
+        std::vector<char>** blks, int nblk) {
+/*-----------------------------------------------------------------------------
+ * As above, for a reply that ends in nblk blocks, e.g. CURVE? for a list of
+ * sources.  The text before the first block is returned in pre, block i in
+ * *blks[i].  Text between the blocks (separators) is skipped.
+ *---------------------------------------------------------------------------*/
+    return _wtrdBlock(cmnd, strlen(cmnd), pre, blks, nblk);
+}
+
+
+asynStatus drvScope::_wtrdBlock(const char* pw, size_t nw, std::string& pre,
+        std::vector<char>** blks, int nblk) {
+/*-----------------------------------------------------------------------------
+ * Writes a query and reads a reply ending in nblk definite length blocks.
+ * The reply is read in chunks: the text up to and including each "#N<len>"
+ * header through _rbuf, then the data straight into the block, so that the
+ * block size is only limited by memory.  With a bulk socket configured the
+ * exchange goes over that instead of the asyn port, and control requests
+ * are run between the chunks of block data, see _preempt().  Parameters:
+ *  pw   buffer that has data to be written,
+ *  nw   number of bytes of data in pw,
+ *  pre  returns the text preceding the first block header,
+ *  blks returns the block data,
+ *  nblk number of blocks expected.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "_wtrdBlock";
+    asynStatus status = asynSuccess;
+    std::string head, sent;
+    size_t nbw = 0, nbr = 0, got = 0, total = 0, len = 0, hix = 0, ndig = 0;
+    int eom = 0;
+    double tmo = _blockTimeout();
+    epicsTimeStamp t0;
+
+    pre.clear();
+    if (_disconnected) return asynDisconnected;
+
+    pw = _withPending(pw, &nw);
+    if (!_bulkConnect() && _desync && !_resync()) return asynError;
+    epicsTimeGetCurrent(&t0);
+    _wdArm(tmo);
+    status = _blkWriteRead(pw, nw, _rbuf, DBUF_LEN, tmo, &nbw, &nbr, &eom);
+    if (status == asynSuccess) head.assign(_rbuf, nbr);
+
+    for (int k=0; (k < nblk) && (status == asynSuccess); k++) {
+        std::vector<char>& blk = *blks[k];
+
+        // Read until the complete "#N<len>" header is in head
+        while (status == asynSuccess) {
+            hix = head.find('#');
+            if ((hix != std::string::npos) && (head.size() > hix + 1)) {
+                ndig = head[hix+1] - '0';
+                if ((ndig < 1) || (ndig > 9)) {
+                    asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: bad block header, pw=%s\n",
+                            driverName.c_str(), functionName.c_str(), pw);
+                    status = asynError;
+                    break;
+                }
+                if (head.size() >= hix + 2 + ndig) break;
+            }
+            if ((head.size() > BLK_MAXHDR) || (eom & ASYN_EOM_EOS)) {
+                asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: no block header, pw=%s, block %d\n",
+                        driverName.c_str(), functionName.c_str(), pw, k);
+                status = asynError;
+                break;
+            }
+            status = _blkRead(_rbuf, DBUF_LEN, tmo, &nbr, &eom);
+            if (status == asynSuccess) head.append(_rbuf, nbr);
+        }
+        if (status != asynSuccess) break;
+
+        len = strtoul(head.substr(hix + 2, ndig).c_str(), NULL, 10);
+        if (!k) pre.assign(head, 0, hix);
+        blk.resize(len);
+
+        // Data that came in with the header, anything after the block is
+        // kept for the next one
+        got = MIN(len, head.size() - (hix + 2 + ndig));
+        if (got) memcpy(blk.data(), head.data() + hix + 2 + ndig, got);
+        head.erase(0, hix + 2 + ndig + got);
+
+        while (got < len) {
+            status = _blkRead(&blk[got], len - got, tmo, &nbr, &eom);
+            if ((status != asynSuccess) || !nbr) {
+                if (status == asynSuccess) status = asynTimeout;
+                break;
+            }
+            got += nbr;
+            if ((got < len) && (_bulkSock != INVALID_SOCKET) && _canPreempt()) {
+                // Requests run now may reuse the write-behind buffer pw is in
+                if (sent.empty()) sent.assign(pw, nw);
+                pw = sent.c_str();
+                _wdDisarm();
+                _preempt();
+                if (_wdFired || _disconnected || (_bulkSock == INVALID_SOCKET)) {
+                    status = asynError;
+                    break;
+                }
+                _wdArm(tmo);
+            }
+        }
+        total += got;
+    }
+
+    // The reply ends with a terminator after the last block.  It is either
+    // in head already or still to be read; anything else in its place means
+    // the reply was not the one we asked for.
+    if (status == asynSuccess) {
+        if (head.empty() && !(eom & ASYN_EOM_END)) {
+            if (_blkRead(_rbuf, DBUF_LEN, tmo, &nbr, &eom) == asynSuccess) {
+                head.assign(_rbuf, nbr);
+            } else {
+                _blkDesync();
+            }
+        }
+        if (head.find_first_not_of("\r\n") != std::string::npos) _blkDesync();
+    }
+    _wdDisarm();
+
+    asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: status=%d, pw=%s, nblk=%d, got=%zu\n",
+            driverName.c_str(), functionName.c_str(), status, pw, nblk, total);
+
+    if (status != asynSuccess) {
+        _blkDesync();
+    } else {
+        _linkRate(&t0, total);
+    }
+    _ioResult(status == asynSuccess, functionName.c_str(), status, pw, nbw, total);
+
+    return status;
+}
+
+
+void drvScope::expectBlock(size_t nbytes) {
+/*-----------------------------------------------------------------------------
+ * A protected function for drivers to tell the size of the next block
+ * reply, from the cached preamble, see _blockTimeout().
+ *---------------------------------------------------------------------------*/
+    _blkExpect = nbytes;
+}
+
+
+double drvScope::_blockTimeout() {
+/*-----------------------------------------------------------------------------
+ * Returns the timeout for the next block exchange: TMO_MARGIN times the
+ * time the expected bytes take at the measured throughput, but not below
+ * the bulk floor.  Without expectBlock() the size of the previous reply is
+ * expected.
+ *---------------------------------------------------------------------------*/
+    double tmo = _tmoBulk;
+    size_t n = _blkExpect ? _blkExpect : _blkLast;
+
+    _blkExpect = 0;
+    if (_linkBps > 0.0) {
+        tmo = MAX(tmo, TMO_MARGIN*n/_linkBps);
+    }
+    _blkTmo = tmo;
+    return tmo;
+}
+
+
+void drvScope::_linkRate(epicsTimeStamp* t0, size_t nbytes) {
+/*-----------------------------------------------------------------------------
+ * Updates the moving average of the block throughput with an exchange of
+ * nbytes that started at t0.  The time includes the instrument's time to
+ * first byte, which the timeout has to cover as well.
+ *---------------------------------------------------------------------------*/
+    epicsTimeStamp now;
+    double dt, bps;
+
+    epicsTimeGetCurrent(&now);
+    dt = epicsTimeDiffInSeconds(&now, t0);
+    _blkLast = nbytes;
+    if ((dt <= 0.0) || !nbytes) return;
+
+    bps = nbytes/dt;
+    _linkBps = (_linkBps > 0.0) ? _linkBps + RATE_WEIGHT*(bps - _linkBps) : bps;
+}
+
+
+void drvScope::setTimeouts(double ctl, double bulk) {
+/*-----------------------------------------------------------------------------
+ * Sets the timeout floors in seconds: ctl for control exchanges, bulk for
+ * block and long text replies.  Values <= 0 keep the current setting.
+ *---------------------------------------------------------------------------*/
+    if (ctl > 0.0) _tmoCtl = ctl;
+    if (bulk > 0.0) _tmoBulk = bulk;
+}
+
+
+asynStatus drvScope::_blkWriteRead(const char* pw, size_t nw, char* pr, size_t nr, double tmo,
+        size_t* nbw, size_t* nbr, int* eom) {
+/*-----------------------------------------------------------------------------
+ * Write-read for _wtrdBlock(): over the bulk socket when it is connected,
+ * else over the asyn port.  The bulk socket has no output EOS, so the
+ * terminator is sent here.
+ *---------------------------------------------------------------------------*/
+    std::string msg;
+    struct timeval tv;
+    epicsTimeStamp t;
+    size_t n = 0;
+    ssize_t k;
+    bool held;
+
+    if (_bulkSock == INVALID_SOCKET) {
+        return _ioWriteRead(pw, nw, pr, nr, tmo, nbw, nbr, eom);
+    }
+    epicsTimeGetCurrent(&t);
+
+    if (tmo != _bulkTmo) {
+        tv.tv_sec = (long)tmo;
+        tv.tv_usec = (long)((tmo - tv.tv_sec)*1e6);
+        setsockopt(_bulkSock, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
+        _bulkTmo = tmo;
+    }
+
+    msg.assign(pw, nw);
+    msg += '\n';
+    while (n < msg.size()) {
+        held = _pollUnlock();
+        k = send(_bulkSock, msg.data() + n, msg.size() - n, 0);
+        _pollRelock(held);
+        if (k <= 0) {
+            _capture(enCapWrite, &t, asynError, 0, pw, 0);
+            _bulkClose();
+            return asynError;
+        }
+        n += k;
+    }
+    *nbw = nw;
+    _capture(enCapWrite, &t, asynSuccess, 0, pw, nw);
+
+    return _blkRead(pr, nr, tmo, nbr, eom);
+}
+
+
+asynStatus drvScope::_blkRead(char* pr, size_t nr, double tmo, size_t* nbr, int* eom) {
+/*-----------------------------------------------------------------------------
+ * Read for _wtrdBlock(), see _blkWriteRead().  Reads from the bulk socket go
+ * straight into pr, which is the trace buffer for block data.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "_blkRead";
+    ssize_t k;
+    bool held;
+
+    if (_bulkSock == INVALID_SOCKET) {
+        return _ioRead(pr, nr, tmo, nbr, eom);
+    }
+
+    *nbr = 0;
+    *eom = 0;
+    held = _pollUnlock();
+    k = recv(_bulkSock, pr, nr, 0);
+    _pollRelock(held);
+    if (k > 0) {
+        *nbr = k;
+        if ((size_t)k == nr) *eom = ASYN_EOM_CNT;
+        _capture(enCapRead, NULL, asynSuccess, *eom, pr, *nbr);
+        return asynSuccess;
+    }
+    _capture(enCapRead, NULL, k ? asynTimeout : asynDisconnected, 0, pr, 0);
+
+    asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: %s, closing bulk socket\n",
+            driverName.c_str(), functionName.c_str(),
+            k ? "read timeout" : "connection closed by peer");
+    _bulkClose();
+    return k ? asynTimeout : asynDisconnected;
+}
+
+
+void drvScope::_blkDesync() {
+/*-----------------------------------------------------------------------------
+ * A block reply is out of step.  The bulk socket is simply reconnected,
+ * the asyn port is resynchronized.
+ *---------------------------------------------------------------------------*/
+    if (_bulkSock != INVALID_SOCKET) {
+        _bulkClose();
+    } else {
+        _desync = true;
+    }
+}
+
+
+asynStatus drvScope::bulkConfigure(const char* hostport, int rcvbuf) {
+/*-----------------------------------------------------------------------------
+ * Sets up a bulk socket for block replies.  Parameters:
+ *  hostport  "host:port" of the instrument's raw socket server,
+ *  rcvbuf    SO_RCVBUF size in bytes, 0 for the system default.
+ * The socket is connected on first use, see _bulkConnect().
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "bulkConfigure";
+    struct sockaddr_in addr;
+
+    if (!hostport || aToIPAddr(hostport, 0, &addr) || !addr.sin_port) {
+        asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: bad host:port %s\n",
+                driverName.c_str(), functionName.c_str(), hostport ? hostport : "");
+        return asynError;
+    }
+
+    _bulkHost = hostport;
+    _bulkRcvBuf = rcvbuf;
+    return asynSuccess;
+}
+
+
+bool drvScope::_bulkConnect() {
+/*-----------------------------------------------------------------------------
+ * Connects the bulk socket if it is configured and not connected.  Returns
+ * true when it is connected.  After a failure the next attempt waits for
+ * BULK_RETRY seconds, block replies use the asyn port meanwhile.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "_bulkConnect";
+    struct sockaddr_in addr;
+    struct timeval tmo;
+    osiSocklen_t len = sizeof(int);
+    epicsTimeStamp now;
+    SOCKET sock;
+    int on = 1, size = 0, rc;
+    bool held;
+    char err[64];
+
+    if (_bulkSock != INVALID_SOCKET) return true;
+    if (_bulkHost.empty()) return false;
+
+    epicsTimeGetCurrent(&now);
+    if (epicsTimeDiffInSeconds(&now, &_bulkRetry) < 0.0) return false;
+    _bulkRetry = now;
+    epicsTimeAddSeconds(&_bulkRetry, BULK_RETRY);
+
+    if (aToIPAddr(_bulkHost.c_str(), 0, &addr)) return false;
+
+    sock = epicsSocketCreate(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return false;
+
+    // The receive buffer has to be set before connect for the TCP window
+    // scale to be negotiated
+    if (_bulkRcvBuf > 0) {
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char*)&_bulkRcvBuf, sizeof(int));
+    }
+    tmo.tv_sec = (long)_tmoBulk;
+    tmo.tv_usec = (long)((_tmoBulk - tmo.tv_sec)*1e6);
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&tmo, sizeof(tmo));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&tmo, sizeof(tmo));
+    _bulkTmo = _tmoBulk;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&on, sizeof(on));
+
+    held = _pollUnlock();
+    rc = connect(sock, (struct sockaddr*)&addr, sizeof(addr));
+    _pollRelock(held);
+    if (rc) {
+        epicsSocketConvertErrnoToString(err, sizeof(err));
+        asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: can't connect to %s: %s\n",
+                driverName.c_str(), functionName.c_str(), _bulkHost.c_str(), err);
+        epicsSocketDestroy(sock);
+        return false;
+    }
+
+    getsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char*)&size, &len);
+    asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: connected to %s, SO_RCVBUF=%d\n",
+            driverName.c_str(), functionName.c_str(), _bulkHost.c_str(), size);
+
+    _bulkSock = sock;
+    return true;
+}
+
+
+void drvScope::_bulkClose() {
+/*-----------------------------------------------------------------------------
+ * Closes the bulk socket, it is reconnected on the next block reply.
+ *---------------------------------------------------------------------------*/
+    if (_bulkSock == INVALID_SOCKET) return;
+
+    _wdLock.lock();
+    epicsSocketDestroy(_bulkSock);
+    _bulkSock = INVALID_SOCKET;
+    _wdLock.unlock();
+}
+
+
+asynStatus drvScope::capture(const char* file) {
+/*-----------------------------------------------------------------------------
+ * Starts recording every write, read and flush on the instrument link to
+ * file, for drvScopeReplay.  Records are listed in drvScopeReplay.h.  A
+ * NULL or empty file name stops the capture.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "capture";
+    asynStatus status = asynSuccess;
+
+    _capLock.lock();
+    if (_capFile) {
+        fclose(_capFile);
+        _capFile = NULL;
+        asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: %u record(s) in %s\n",
+                driverName.c_str(), functionName.c_str(), _capRecs, _capName.c_str());
+    }
+    if (file && *file) {
+        _capFile = fopen(file, "wb");
+        if (_capFile && (fwrite(CAP_MAGIC, 1, CAP_MAGIC_LEN, _capFile) == CAP_MAGIC_LEN)) {
+            _capName = file;
+            _capRecs = 0;
+            epicsTimeGetCurrent(&_capStart);
+        } else {
+            asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: can't write %s\n",
+                    driverName.c_str(), functionName.c_str(), file);
+            if (_capFile) fclose(_capFile);
+            _capFile = NULL;
+            status = asynError;
+        }
+    }
+    _capLock.unlock();
+    return status;
+}
+
+
+void drvScope::_capture(int type, epicsTimeStamp* t, asynStatus status, int eom,
+        const char* p, size_t n) {
+/*-----------------------------------------------------------------------------
+ * Appends a record to the capture file, if there is one.  t is the time of
+ * the operation, NULL for now.  A write error stops the capture.
+ *---------------------------------------------------------------------------*/
+    capRec_t rec;
+    epicsTimeStamp now;
+
+    if (!_capFile) return;
+    if (!t) {
+        epicsTimeGetCurrent(&now);
+        t = &now;
+    }
+
+    _capLock.lock();
+    if (_capFile) {
+        rec.t = epicsTimeDiffInSeconds(t, &_capStart);
+        rec.len = (epicsUInt32)n;
+        rec.type = (epicsInt8)type;
+        rec.status = (epicsInt8)status;
+        rec.eom = (epicsInt8)eom;
+        rec.spare = 0;
+        if ((fwrite(&rec, sizeof(rec), 1, _capFile) != 1) ||
+                (n && (fwrite(p, 1, n, _capFile) != n))) {
+            asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::_capture: write to %s failed, stopped\n",
+                    driverName.c_str(), _capName.c_str());
+            fclose(_capFile);
+            _capFile = NULL;
+        } else {
+            _capRecs++;
+        }
     }
-    return status;
+    _capLock.unlock();
 }
 
 
-asynStatus drvScope::_wtrd(const char* pw, size_t nw, char* pr, size_t nr) {
+asynStatus drvScope::_ioWrite(const char* pw, size_t nw, double tmo, size_t* nbw) {
 /*-----------------------------------------------------------------------------
- * Here we perform an "atomic" write and read operation sequence.  Parameters:
- *  pw  buffer that has data to be written,
- *  nw  number of bytes of data in pwb,
- *  pr  buffer into which data will be read in,
- *  nr  size of read buffer in bytes,
+ * All I/O on the asyn port goes through _ioWrite(), _ioWriteRead(),
+ * _ioRead() and _ioFlush(), which record it when a capture is on.  After
+ * the watchdog cancelled an exchange they fail at once until _recover(),
+ * and their timeouts end at the watchdog deadline, see _wdClamp().
  *---------------------------------------------------------------------------*/
-    const std::string functionName = "_wtrd";
-    asynStatus status = asynSuccess;
-    int eom;
-    size_t nbw, nbr;
-
-    pasynOctetSyncIO->flush(pasynUser);
-    status = pasynOctetSyncIO->writeRead(pasynUser, pw, nw, pr, nr, 1, &nbw, &nbr, &eom);
+    asynStatus status;
+    epicsTimeStamp t;
+    bool held;
+
+    *nbw = 0;
+    if (_wdFired) return asynTimeout;
+    epicsTimeGetCurrent(&t);
+    held = _pollUnlock();
+    status = pasynOctetSyncIO->write(pasynUser, pw, nw, _wdClamp(tmo), nbw);
+    _pollRelock(held);
+    _capture(enCapWrite, &t, status, 0, pw, *nbw);
+    if (_wdCheck()) status = asynTimeout;
+    return status;
+}
 
-    asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: status=%d, pw=%s\n",
-            driverName.c_str(), functionName.c_str(), status, pw);
 
-    if ((status != asynSuccess) || !nbr || (nbr > nr)) {
-        // Allow 5 errors, then set connected state
-        if (_err_count < 5) {
-            asynPrint(pasynUser, ASYN_TRACE_ERROR,
-                    "%s::%s: ERROR: status=%d, pw=%s, nbw=%zu, nbr=%zu\n",
-                    driverName.c_str(), functionName.c_str(), status, pw, nbw, nbr);
-        } else if (_err_count == 5) {
-            setConnectedState(false);
-        }
-        _err_count++;
-    } else {
-        if (_err_count) {
-            setConnectedState(true);
-        }
+asynStatus drvScope::_ioWriteRead(const char* pw, size_t nw, char* pr, size_t nr, double tmo,
+        size_t* nbw, size_t* nbr, int* eom) {
+/*-----------------------------------------------------------------------------
+ * See _ioWrite().  Records the write and the read separately, the replay
+ * port sees them as such.
+ *---------------------------------------------------------------------------*/
+    asynStatus status;
+    epicsTimeStamp t;
+    bool held;
+
+    *nbw = *nbr = 0;
+    *eom = 0;
+    if (_wdFired) return asynTimeout;
+    epicsTimeGetCurrent(&t);
+    held = _pollUnlock();
+    status = pasynOctetSyncIO->writeRead(pasynUser, pw, nw, pr, nr, _wdClamp(tmo), nbw, nbr, eom);
+    _pollRelock(held);
+    if (_capFile) {
+        // writeRead() does not say which half failed
+        _capture(enCapWrite, &t, *nbw ? asynSuccess : status, 0, pw, *nbw);
+        if (*nbw) _capture(enCapRead, NULL, status, *eom, pr, *nbr);
     }
+    if (_wdCheck()) status = asynTimeout;
+    return status;
+}
+
 
+asynStatus drvScope::_ioRead(char* pr, size_t nr, double tmo, size_t* nbr, int* eom) {
+/*-----------------------------------------------------------------------------
+ * See _ioWrite().
+ *---------------------------------------------------------------------------*/
+    asynStatus status;
+    bool held;
+
+    *nbr = 0;
+    *eom = 0;
+    if (_wdFired) return asynTimeout;
+    held = _pollUnlock();
+    status = pasynOctetSyncIO->read(pasynUser, pr, nr, _wdClamp(tmo), nbr, eom);
+    _pollRelock(held);
+    _capture(enCapRead, NULL, status, *eom, pr, *nbr);
+    if (_wdCheck()) status = asynTimeout;
     return status;
 }
 
 
+void drvScope::_ioFlush() {
+/*-----------------------------------------------------------------------------
+ * See _ioWrite().
+ *---------------------------------------------------------------------------*/
+    bool held = _pollUnlock();
+
+    pasynOctetSyncIO->flush(pasynUser);
+    _pollRelock(held);
+    _capture(enCapFlush, NULL, asynSuccess, 0, NULL, 0);
+}
+
+
 void drvScope::setConnectedState(int state) {
 /*-----------------------------------------------------------------------------
  *---------------------------------------------------------------------------*/
@@ -422,6 +1970,7 @@ void drvScope::setConnectedState(int state) {
         stat = COMM_ALARM;
         sevr = INVALID_ALARM;
     }
+    _disconnected = !state;
 
     // Set error state
     setIntegerParam(_biState, state);
@@ -451,7 +2000,7 @@ void drvScope::getChanPos(int addr) {
  * needs to be reimplemented for other scope types, e.g. Rigol.
  * addr is parameter library index or addr+1 channel
  *---------------------------------------------------------------------------*/
-    getFloat(ixAoChPos, _aoChPos, addr+1);
+    batchFloat(ixAoChPos, _aoChPos, addr+1);
 }
 
 
@@ -480,10 +2029,14 @@ void drvScope::saveConfig() {
     const std::string functionName = "saveConfig"; 
     const char* pcmd = getCommand(ixBoSave);
     asynStatus status;
+    std::string str;
 
     if (!pcmd) return;
 
-    status = command(pcmd);
+    status = _wtrdText(pcmd, strlen(pcmd), str);
+    if (status == asynSuccess) {
+        setStringParam(_wfReply, str.c_str());
+    }
     if (status != asynSuccess) {
         asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: command failed\n", 
                 driverName.c_str(), functionName.c_str());
@@ -497,7 +2050,7 @@ void drvScope::saveConfig() {
         return;
     }
 
-    int st = fputs(_rbuf, fd);
+    int st = fputs(str.c_str(), fd);
     if (st == EOF) {
         asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: fputs failed\n", 
                 driverName.c_str(), functionName.c_str());
@@ -622,6 +2175,7 @@ asynStatus drvScope::putIntCmnds(int ix, int addr, int v) {
     const std::string functionName = "putIntCmnds";
     asynStatus status = asynSuccess;
     char cmnd[32]; 
+    bool held;
     int ch = addr + 1;
     int jx = ix - _firstix;
     const char* pcmd = getCommand(jx);
@@ -669,7 +2223,19 @@ asynStatus drvScope::putIntCmnds(int ix, int addr, int v) {
             setIntegerParam(addr, ix, v);
             break;
         case ixBoGetWf:
+            if ((addr < 0) || (addr >= NCHAN)) break;
+            // procThread may still be processing this channel
+            held = _pollUnlock();
+            _wfFree[addr].wait();
+            _pollRelock(held);
             getWaveform(addr);
+            _wfFree[addr].signal();
+            break;
+        case ixBoGetWfA:
+            _getTraces(_pipeline);
+            break;
+        case ixBoMeasEnabled:
+            if (v) getMeasurements(0);
             break;
         case ixBoStop:
         case ixBoRun:
@@ -741,7 +2307,9 @@ asynStatus drvScope::getCmnds(int ix, int addr) {
     int jx = ix - _firstix;
     double dv;
 
-    _opc();
+    if (_opcPending) {
+        _opc();
+    }
 
     switch(jx) {
         case ixWfIdn:
@@ -822,17 +2390,19 @@ asynStatus drvScope::getCmnds(int ix, int addr) {
 
 int drvScope::_opc() {
 /*-----------------------------------------------------------------------------
- * OPC query and returns as a function value result returned.
+ * OPC query and returns as a function value result returned.  Clears
+ * _opcPending once the scope reports the pending operations complete.
  *---------------------------------------------------------------------------*/
     const std::string functionName = "_opc"; 
     asynStatus status = asynSuccess;
     int count = 0, tries = 0, value = 0;
+    bool held;
     char* p;
 
     _rbuf[0] = 0;
 
     while(1) {
-        status = _wtrd("*OPC?", 5, _rbuf, DBUF_LEN);
+        status = _wtrd("*OPC?", 5, _rbuf, DBUF_LEN, _tmoBulk);
         if (status == asynSuccess) {
             p = strchr(_rbuf, '\n');
             if (p) {
@@ -841,13 +2411,16 @@ int drvScope::_opc() {
 
             value = atoi(_rbuf);
             if (value == 1) {
+                _opcPending = false;
                 break;
             }
             if ((++count) > 10) {
                 value = 0;
                 break;
             }
+            held = _pollUnlock();
             epicsThreadSleep(0.01);
+            _pollRelock(held);
         }  else if ((++tries) > 1) {
             asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: failed in _wtrd after %d tries\n", 
                     driverName.c_str(), functionName.c_str(), tries);
@@ -1100,7 +2673,7 @@ void drvScope::setInt(int cix, const char* cmnd, int v, int pix) {
 
     if (!pix) return;
 
-    getInt(cix, pix);
+    batchInt(cix, pix);
 }
 
 
@@ -1290,98 +2863,504 @@ void drvScope::setEnum(int cix, int val, int ch) {
     }
 }
 
-void drvScope::setEnum(const char* cmnd, int val, const char** list, int ni, int ch) {
+void drvScope::setEnum(const char* cmnd, int val, const char** list, int ni, int ch) {
+/*-----------------------------------------------------------------------------
+ * ix is a bit position that was selected, this corresponds to an index
+ * into list of size ni from which we extract the value needed to construct
+ * the command.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "setEnum";
+    char str[32];
+
+    asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: cmnd=%s, val=%d, ch=%d\n",
+            driverName.c_str(), functionName.c_str(), cmnd, val, ch);
+
+    if ((val < 0) || (val >= ni)) return;
+
+    if (ch > 0) {
+        sprintf(str, cmnd, ch);
+    } else {
+        sprintf(str, cmnd);
+    }
+    strcat(str, " ");
+    strcat(str, list[val]);
+    command(str);
+}
+
+
+void drvScope::setEnum(const char* cmnd, int val, const std::vector<std::string> list, int ch) {
+/*-----------------------------------------------------------------------------
+ * ix is a bit position that was selected, this corresponds to an index
+ * into list of size ni from which we extract the value needed to construct
+ * the command.
+ *---------------------------------------------------------------------------*/
+    std::string functionName = "setEnum";
+    char str[32];
+        
+    asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: cmnd=%s, val=%d, ch=%d\n",
+            driverName.c_str(), functionName.c_str(), cmnd, val, ch);
+
+    if ((val < 0) || (val >= int(list.size()))) return;
+
+    if (ch > 0) {
+        sprintf(str, cmnd, ch);
+    } else {
+        sprintf(str, cmnd);
+    }
+
+    strcat(str, " ");
+    strcat(str, list[val].c_str());
+    command(str);
+}
+
+
+asynStatus drvScope::getString(int cix, int pix) {
+/*-----------------------------------------------------------------------------
+ * Issues a query for a string value and puts the obtained value in
+ * parameter library at index pix.
+ *---------------------------------------------------------------------------*/
+    const char* cmnd = getCommand(cix);
+    if (!cmnd) return asynError;
+
+    char str[32]; 
+    int len = strlen(cmnd);
+
+    if (len > 30) return asynError;
+
+    strcpy(str, cmnd);
+    return getString(str, pix);
+}
+
+
+asynStatus drvScope::getString(const char* cmnd, int pix) {
+/*-----------------------------------------------------------------------------
+ * Issues a query for a string value and puts the obtained value in
+ * parameter library at index pix.
+ *---------------------------------------------------------------------------*/
+    asynStatus status = asynSuccess;
+    char str[32];
+
+    strcpy(str,cmnd);
+
+    if (!strchr(str,'?')) {
+        strcat(str,"?");
+    }
+
+    status = _wtrd(str, strlen(str), _rbuf, DBUF_LEN);
+
+    if (status == asynSuccess) {
+        char* p = strchr(_rbuf, '\n');
+        if (p) *p = 0;
+        status = setStringParam(pix, _rbuf);
+    }
+
+    return status;
+}
+
+
+void drvScope::batchBegin() {
+/*-----------------------------------------------------------------------------
+ * Starts collecting queries.  batchInt(), batchFloat() and batchEnum() queue
+ * their query, and batchFlush() sends them joined into a few compound
+ * queries and puts the values in the parameter library.  When the driver
+ * cannot batch, canBatch() false, they query right away instead.
+ *---------------------------------------------------------------------------*/
+    if (!_batchQ.empty()) batchFlush();
+    _batchQ.clear();
+    _batching = canBatch();
+}
+
+
+asynStatus drvScope::batchFlush() {
+/*-----------------------------------------------------------------------------
+ * Sends the collected queries as "Q1?;:Q2?;..." of up to QBATCH_LEN
+ * characters each, splits the semicolon separated replies and routes each
+ * field to its parameter.  During update() the queries found in the
+ * snapshot are answered from it instead.  Queries go on being collected
+ * while writes are held back, see _writeBehindBegin().
+ *---------------------------------------------------------------------------*/
+    asynStatus status = asynSuccess;
+    std::string query;
+    size_t i = 0, j;
+
+    _batching = false;
+    if (_useSnap) {
+        _batchFromSnapshot();
+    }
+
+    while (i < _batchQ.size()) {
+        query = _batchQ[i].query;
+        for (j=i+1; j<_batchQ.size(); j++) {
+            if (query.size() + _batchQ[j].query.size() + 2 > QBATCH_LEN) break;
+            _joinCmnd(query, _batchQ[j].query.c_str(), _batchQ[j].query.size());
+        }
+        if (_batchQuery(query, i, j) != asynSuccess) status = asynError;
+        i = j;
+    }
+
+    _batchQ.clear();
+    _batching = _writeBehind;
+    return status;
+}
+
+
+void drvScope::batchInt(int cix, int pix, int ch) {
+/*-----------------------------------------------------------------------------
+ * Queues a query for an integer value, see getInt().
+ *---------------------------------------------------------------------------*/
+    const char* cmnd = getCommand(cix);
+    if (!cmnd) return;
+    batchInt(cmnd, pix, ch);
+}
+
+
+void drvScope::batchInt(const char* cmnd, int pix, int ch) {
+/*-----------------------------------------------------------------------------
+ * Queues a query for an integer value, see getInt().
+ *---------------------------------------------------------------------------*/
+    if (!_batching) {
+        getInt(cmnd, pix, ch);
+        return;
+    }
+    _batchAdd(enBtInt, cmnd, pix, ch);
+}
+
+
+void drvScope::batchFloat(int cix, int pix, int ch) {
+/*-----------------------------------------------------------------------------
+ * Queues a query for a floating point value, see getFloat().
+ *---------------------------------------------------------------------------*/
+    const char* cmnd = getCommand(cix);
+    if (!cmnd) return;
+    batchFloat(cmnd, pix, ch);
+}
+
+
+void drvScope::batchFloat(const char* cmnd, int pix, int ch) {
+/*-----------------------------------------------------------------------------
+ * Queues a query for a floating point value, see getFloat().
+ *---------------------------------------------------------------------------*/
+    if (!_batching) {
+        getFloat(cmnd, pix, ch);
+        return;
+    }
+    _batchAdd(enBtFlt, cmnd, pix, ch);
+}
+
+
+void drvScope::batchEnum(int cix, int pix, int ch) {
+/*-----------------------------------------------------------------------------
+ * Queues a query for an enumerated value, see getEnum().  The keywords come
+ * from getCmndList() or, when that has none, from getKeywordList().
+ *---------------------------------------------------------------------------*/
+    const char* cmnd;
+    const char** list;
+    uint ni;
+
+    if (!_batching) {
+        getEnum(cix, pix, ch);
+        return;
+    }
+
+    cmnd = getCommand(cix);
+    if (!cmnd) return;
+
+    list = getCmndList(cix, &ni);
+    if (list) {
+        _batchAdd(enBtEnum, cmnd, pix, ch, list, ni);
+        return;
+    }
+
+    std::vector<std::string> vlist = getKeywordList(cix);
+    if (vlist.empty()) return;
+    _batchAdd(enBtEnum, cmnd, pix, ch, NULL, 0, vlist);
+}
+
+
+void drvScope::batchEnum(const char* cmnd, int pix, std::vector<std::string> list, int ch) {
+/*-----------------------------------------------------------------------------
+ * Queues a query for an enumerated value, see getEnum().
+ *---------------------------------------------------------------------------*/
+    if (!_batching) {
+        getEnum(cmnd, pix, list, ch);
+        return;
+    }
+    _batchAdd(enBtEnum, cmnd, pix, ch, NULL, 0, list);
+}
+
+
+void drvScope::_batchAdd(int type, const char* cmnd, int pix, int ch,
+        const char** list, int ni, std::vector<std::string> vlist) {
+/*-----------------------------------------------------------------------------
+ * Makes the query string for cmnd and channel ch the way getInt() does and
+ * adds it to the batch.
+ *---------------------------------------------------------------------------*/
+    batchq_t q;
+    char str[32];
+
+    if ((strlen(cmnd) > 30) || (ch < 0) || (ch > NCHAN)) return;
+
+    if (ch > 0) {
+        sprintf(str, cmnd, ch);
+    } else {
+        sprintf(str, cmnd);
+    }
+    if (!strchr(str, '?')) {
+        strcat(str, "?");
+    }
+
+    q.type = type;
+    q.query = str;
+    q.pix = pix;
+    q.addr = (ch > 0) ? ch - 1 : 0;
+    q.list = list;
+    q.ni = ni;
+    q.vlist = vlist;
+    _batchQ.push_back(q);
+}
+
+
+asynStatus drvScope::_batchQuery(const std::string& query, size_t i0, size_t i1) {
+/*-----------------------------------------------------------------------------
+ * Sends the compound query made of batch items i0..i1-1 and sets their
+ * parameters from the reply.  If the reply does not have one field per item
+ * the items are queried one by one.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "_batchQuery";
+    asynStatus status = asynSuccess;
+    std::vector<char*> fields;
+    char* p;
+
+    status = _wtrd(query.c_str(), query.size(), _rbuf, DBUF_LEN);
+    if (status == asynSuccess) {
+        p = strchr(_rbuf, '\n');
+        if (p) *p = 0;
+        fields.push_back(_rbuf);
+        for (p=_rbuf; (p = strchr(p, ';')); ) {
+            *p++ = 0;
+            fields.push_back(p);
+        }
+    }
+
+    // More fields than queries means a late reply got in front of this one
+    if (fields.size() > i1 - i0) desync();
+
+    if (fields.size() == i1 - i0) {
+        for (size_t i=i0; i<i1; i++) {
+            _batchSet(&_batchQ[i], fields[i-i0]);
+        }
+        return asynSuccess;
+    }
+
+    asynPrint(pasynUser, ASYN_TRACE_FLOW,
+            "%s::%s: %zu fields for %zu queries, querying one by one, query=%s\n",
+            driverName.c_str(), functionName.c_str(), fields.size(), i1 - i0, query.c_str());
+
+    for (size_t i=i0; i<i1; i++) {
+        const std::string& q = _batchQ[i].query;
+        if (_wtrd(q.c_str(), q.size(), _rbuf, DBUF_LEN) == asynSuccess) {
+            _batchSet(&_batchQ[i], _rbuf);
+        } else {
+            status = asynError;
+        }
+    }
+
+    return status;
+}
+
+
+asynStatus drvScope::_batchSet(batchq_t* pq, char* val) {
 /*-----------------------------------------------------------------------------
- * ix is a bit position that was selected, this corresponds to an index
- * into list of size ni from which we extract the value needed to construct
- * the command.
+ * Puts the reply val to the query pq in the parameter library.
  *---------------------------------------------------------------------------*/
-    const std::string functionName = "setEnum";
-    char str[32];
+    int ix;
+
+    switch(pq->type) {
+        case enBtInt:
+            return setIntegerParam(pq->addr, pq->pix, atoi(val));
+        case enBtFlt:
+            return setDoubleParam(pq->addr, pq->pix, atof(val));
+        case enBtEnum:
+            ix = pq->list ? _find(val, pq->list, pq->ni) : _find(val, pq->vlist);
+            if (ix < 0) return asynError;
+            return setIntegerParam(pq->addr, pq->pix, ix);
+    }
 
-    asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: cmnd=%s, val=%d, ch=%d\n",
-            driverName.c_str(), functionName.c_str(), cmnd, val, ch);
+    return asynError;
+}
 
-    if ((val < 0) || (val >= ni)) return;
 
-    if (ch > 0) {
-        sprintf(str, cmnd, ch);
-    } else {
-        sprintf(str, cmnd);
+void drvScope::_batchFromSnapshot() {
+/*-----------------------------------------------------------------------------
+ * Answers the batched queries that have a setting in the snapshot and drops
+ * them from the batch.  Only settings that changed since the previous
+ * snapshot are put in the parameter library.
+ *---------------------------------------------------------------------------*/
+    std::vector<batchq_t> rest;
+    std::vector<char> val;
+    setting_t* ps;
+
+    for (size_t i=0; i<_batchQ.size(); i++) {
+        ps = _findSetting(_batchQ[i].query);
+        if (!ps) {
+            rest.push_back(_batchQ[i]);
+            continue;
+        }
+        if (ps->changed) {
+            val.assign(ps->value.begin(), ps->value.end());
+            val.push_back(0);
+            _batchSet(&_batchQ[i], val.data());
+        }
     }
-    strcat(str, " ");
-    strcat(str, list[val]);
-    command(str);
+
+    _batchQ.swap(rest);
 }
 
 
-void drvScope::setEnum(const char* cmnd, int val, const std::vector<std::string> list, int ch) {
+bool drvScope::_takeSnapshot() {
 /*-----------------------------------------------------------------------------
- * ix is a bit position that was selected, this corresponds to an index
- * into list of size ni from which we extract the value needed to construct
- * the command.
+ * Reads the whole instrument state with the configuration query (SET?,
+ * *LRN?) and parses it into _snap.  Returns true when there are settings to
+ * answer queries from.
  *---------------------------------------------------------------------------*/
-    std::string functionName = "setEnum";
-    char str[32];
-        
-    asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: cmnd=%s, val=%d, ch=%d\n",
-            driverName.c_str(), functionName.c_str(), cmnd, val, ch);
+    const std::string functionName = "_takeSnapshot";
+    const char* pcmd = getCommand(ixBoSave);
+    std::string str;
+    int n, nchanged = 0;
 
-    if ((val < 0) || (val >= int(list.size()))) return;
+    if (!pcmd) return false;
 
-    if (ch > 0) {
-        sprintf(str, cmnd, ch);
-    } else {
-        sprintf(str, cmnd);
+    if (_wtrdText(pcmd, strlen(pcmd), str) != asynSuccess) return false;
+
+    // Settings were written since the previous snapshot, so the parameters
+    // may not match it any more: treat every setting as changed.
+    if (_snapGen != preambleGen()) {
+        _snapOld.clear();
+        _snapGen = preambleGen();
     }
 
-    strcat(str, " ");
-    strcat(str, list[val].c_str());
-    command(str);
+    n = _parseSnapshot(str);
+    for (size_t i=0; i<_snap.size(); i++) {
+        if (_snap[i].changed) nchanged++;
+    }
+
+    asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: %d settings, %d changed\n",
+            driverName.c_str(), functionName.c_str(), n, nchanged);
+
+    return n > 0;
 }
 
 
-asynStatus drvScope::getString(int cix, int pix) {
+int drvScope::_parseSnapshot(const std::string& str) {
 /*-----------------------------------------------------------------------------
- * Issues a query for a string value and puts the obtained value in
- * parameter library at index pix.
+ * Splits the snapshot str into settings, "HEADER value" separated by ';'
+ * outside of quoted strings.  A header without a leading ':' is relative to
+ * the path of the previous one, e.g. ":CH1:POS 0;SCA 1" has CH1:SCA.  Common
+ * commands are skipped.  Marks the settings that differ from the previous
+ * snapshot.  Returns the number of settings.
  *---------------------------------------------------------------------------*/
-    const char* cmnd = getCommand(cix);
-    if (!cmnd) return asynError;
+    std::vector<std::string> path;
+    std::string item, hdr, node, key;
+    std::map<std::string, std::string>::iterator it;
+    setting_t st;
+    bool quote = false;
+    size_t i0 = 0, n;
+
+    _snap.clear();
+
+    for (size_t i=0; i<=str.size(); i++) {
+        char c = (i < str.size()) ? str[i] : ';';
+        if (c == '"') quote = !quote;
+        if ((c != ';') || quote) continue;
+
+        item = str.substr(i0, i - i0);
+        i0 = i + 1;
+        n = item.find_first_not_of(" \t\r\n");
+        if ((n == std::string::npos) || (item[n] == '*')) continue;
+        item.erase(0, n);
+
+        n = item.find_first_of(" \t");
+        hdr = item.substr(0, n);
+        st.value = (n == std::string::npos) ? "" : item.substr(n + 1);
+        st.nodes.clear();
+        if (hdr[0] != ':') st.nodes = path;
+
+        node.clear();
+        for (size_t k=0; k<=hdr.size(); k++) {
+            c = (k < hdr.size()) ? toupper(hdr[k]) : ':';
+            if (c != ':') {
+                node += c;
+            } else if (!node.empty()) {
+                st.nodes.push_back(node);
+                node.clear();
+            }
+        }
+        if (st.nodes.empty()) continue;
+        path.assign(st.nodes.begin(), st.nodes.end() - 1);
 
-    char str[32]; 
-    int len = strlen(cmnd);
+        key.clear();
+        for (size_t k=0; k<st.nodes.size(); k++) {
+            key += (k ? ":" : "") + st.nodes[k];
+        }
+        it = _snapOld.find(key);
+        st.changed = (it == _snapOld.end()) || (it->second != st.value);
+        _snapOld[key] = st.value;
 
-    if (len > 30) return asynError;
+        _snap.push_back(st);
+    }
 
-    strcpy(str, cmnd);
-    return getString(str, pix);
+    return _snap.size();
 }
 
 
-asynStatus drvScope::getString(const char* cmnd, int pix) {
+setting_t* drvScope::_findSetting(const std::string& query) {
 /*-----------------------------------------------------------------------------
- * Issues a query for a string value and puts the obtained value in
- * parameter library at index pix.
+ * Returns the snapshot setting for query, e.g. "CH1:SCA?", or NULL.  Headers
+ * match when they have the same nodes, each short or long form.
  *---------------------------------------------------------------------------*/
-    asynStatus status = asynSuccess;
-    char str[32];
-
-    strcpy(str,cmnd);
+    std::vector<std::string> nodes;
+    std::string node;
+    size_t k;
+
+    for (k=0; k<=query.size(); k++) {
+        char c = (k < query.size()) ? toupper(query[k]) : ':';
+        if (c == '?') continue;
+        if (c != ':') {
+            node += c;
+        } else if (!node.empty()) {
+            nodes.push_back(node);
+            node.clear();
+        }
+    }
+    if (nodes.empty() || (nodes[0][0] == '*')) return NULL;
 
-    if (!strchr(str,'?')) {
-        strcat(str,"?");
+    for (size_t i=0; i<_snap.size(); i++) {
+        if (_snap[i].nodes.size() != nodes.size()) continue;
+        for (k=0; k<nodes.size(); k++) {
+            if (!_nodeMatch(nodes[k], _snap[i].nodes[k])) break;
+        }
+        if (k == nodes.size()) return &_snap[i];
     }
 
-    status = _wtrd(str, strlen(str), _rbuf, DBUF_LEN);
+    return NULL;
+}
 
-    if (status == asynSuccess) {
-        char* p = strchr(_rbuf, '\n');
-        if (p) *p = 0;
-        status = setStringParam(pix, _rbuf);
-    }
 
-    return status;
+bool drvScope::_nodeMatch(const std::string& a, const std::string& b) {
+/*-----------------------------------------------------------------------------
+ * Compares two upper case header nodes: the letters of one must start the
+ * letters of the other, as for the short and long form of a SCPI mnemonic,
+ * and the numeric suffixes must be equal, e.g. "SCA" and "SCALE", "CH1" and
+ * "CH1", but not "CH1" and "CH2".
+ *---------------------------------------------------------------------------*/
+    size_t na = a.find_first_of("0123456789");
+    size_t nb = b.find_first_of("0123456789");
+
+    if (na == std::string::npos) na = a.size();
+    if (nb == std::string::npos) nb = b.size();
+
+    if (a.compare(na, std::string::npos, b, nb, std::string::npos)) return false;
+    return a.compare(0, MIN(na, nb), b, 0, MIN(na, nb)) == 0;
 }
 
 
@@ -1498,18 +3477,20 @@ void drvScope::_selectChannel() {
 
 void drvScope::setChanPosition() {
 /*-----------------------------------------------------------------------------
- * Called by epicsTimerNotify::expire() at end of slider move.
+ * Called by epicsTimerNotify::expire() at end of slider move.  The timer
+ * thread must not do I/O, the position is queued as a write to AO_CHPOS of
+ * the selected channel.
  *---------------------------------------------------------------------------*/
-    setChanPos(_chSel, _chPos);
-    //getFloat(ixAoChPos, _aoChPos, _chSel+1);
-    getChanPos(_chSel);
-    getTrigLevl();
+    lock();
+    putInMessgQ(enPutFlt, _aoChPos, _chSel, 0, _chPos);
+    unlock();
 }
 
 
 asynStatus drvScope::writeOctet(asynUser* pasynUser, const char* v, size_t nc, size_t* nActual) {
 /*-----------------------------------------------------------------------------
- * This method overrides the virtual method in asynPortDriver.
+ * This method overrides the virtual method in asynPortDriver.  A command is
+ * queued for the poller, its reply comes as a callback on WF_REPLY.
  *---------------------------------------------------------------------------*/
     const std::string functionName = "writeOctet";
     asynStatus status = asynSuccess;
@@ -1526,8 +3507,7 @@ asynStatus drvScope::writeOctet(asynUser* pasynUser, const char* v, size_t nc, s
 
     switch(jx) {
         case ixSoCmnd:
-            status = command(v);
-            *nActual = nc;
+            putInMessgQ(enCommand, ix, addr, 0, 0.0, std::string(v, nc).c_str());
             break;
         case ixWfFPath:
             strncpy(_fname, v, FNAME);
@@ -1589,9 +3569,6 @@ asynStatus drvScope::writeInt32(asynUser* pasynUser, epicsInt32 v) {
         case ixLoMark2:
             _mix2[_markchan] = v;
             break;
-        case ixBoGetWfA:
-            _getTraces();
-            break;
         case ixBoRdTraces:
             _rdtraces = v;
             setIntegerParam(_boRdTraces, v);
@@ -1599,7 +3576,20 @@ asynStatus drvScope::writeInt32(asynUser* pasynUser, epicsInt32 v) {
         case ixBoMeasEnabled:
             _measEnabled = v;
             setIntegerParam(_boMeasEnabled, v);
-            getMeasurements(0);
+            putInMessgQ(enPutInt, ix, addr, v);
+            break;
+        case ixBoPipe:
+            _pipeline = v;
+            setIntegerParam(_boPipe, v);
+            break;
+        case ixBoBatch:
+            _batch = v;
+            setIntegerParam(_boBatch, v);
+            break;
+        case ixBoAdapt:
+            _adapt = v;
+            _acqForce = true;
+            setIntegerParam(_boAdapt, v);
             break;
         case ixMbboTracMod:
             setIntegerParam(addr, _mbboTracMod, v);
@@ -1640,6 +3630,11 @@ asynStatus drvScope::writeFloat64(asynUser* pasynUser, epicsFloat64 v) {
         case ixAoPTMO:
             _pollT = v;
             break;
+        case ixAoPTMax:
+            _pollTMax = v;
+            setDoubleParam(_aoPTMax, v);
+            callParamCallbacks();
+            break;
         default:
             putInMessgQ(enPutFlt, jx, addr, 0, fv);
             break;
@@ -1649,33 +3644,54 @@ asynStatus drvScope::writeFloat64(asynUser* pasynUser, epicsFloat64 v) {
 }
 
 
-void drvScope::_getTraces() {
+void drvScope::_getTraces(bool pipe) {
 /*-----------------------------------------------------------------------------
  * Initiate getting waveform trace data for all channels.  Traces will be
  * read in asynchronously or synchronously depending on the value of the
  * _tracemode variable.  Synchronous mode is when all four traces are obtained
- * for the same event.
+ * for the same event.  When pipe is true the traces are processed by
+ * procThread.  Only the poller thread may do that; callers holding the port
+ * lock would deadlock with procThread.
  *---------------------------------------------------------------------------*/
     static epicsTimeStamp t1,t2,t3; 
     static bool first = true;
     int tmode;
-    bool istrig = true; 
+    bool istrig = true, held;
     const char* pcmd;
 
     epicsTimeGetCurrent(&t1);
 
     getIntegerParam(_mbboTracMod, &tmode);
     if (tmode == enTMSync){
+        stageMark();
         if ((istrig = isTriggered())) {
             if ((pcmd = getCommand(_boStop))) {
                 command(pcmd);
             }
         }
+        stageTime(enStTrig);
     }
 
     if (istrig) {
-        for (int ch=0; ch<NCHAN; ch++) {
-            getWaveform(ch);
+        if (!_batch || !_getTracesBatch(pipe)) {
+            for (int ch=0; (ch<NCHAN) && !_disconnected && !_wdFired; ch++) {
+                _preempt();
+                // Wait until the previous data of this channel are processed,
+                // also when not pipelined: BO_PIPE may just have been turned off
+                held = _pollUnlock();
+                _wfFree[ch].wait();
+                _pollRelock(held);
+                if (pipe) {
+                    if (fetchWaveform(ch)) {
+                        _ppq->send(&ch, sizeof(ch));
+                    } else {
+                        _wfFree[ch].signal();
+                    }
+                } else {
+                    getWaveform(ch);
+                    _wfFree[ch].signal();
+                }
+            }
         }
         if(tmode == enTMSync) {
             if ((pcmd=getCommand(_boRun))) {
@@ -1710,6 +3726,181 @@ void drvScope::_getTraces() {
 }
 
 
+void drvScope::stageMark() {
+/*-----------------------------------------------------------------------------
+ * Marks the start of a sequence of trace acquisition stages.
+ *---------------------------------------------------------------------------*/
+    epicsTimeGetCurrent(_stageMark());
+}
+
+
+bool drvScope::_getTracesBatch(bool pipe) {
+/*-----------------------------------------------------------------------------
+ * Fetches all channels in one exchange, fetchWaveforms(), and processes the
+ * ones that are ready, in procThread when pipe is true.  Returns false when
+ * the driver does not support batched fetches or the batched fetch failed,
+ * and the caller then reads the channels one by one.  The trace buffers are
+ * taken in either mode, as procThread may still be processing the previous
+ * data.  After BATCH_FAILS failures in a row BO_BATCH is turned off, so a
+ * scope that rejects source lists doesn't cost a timeout at every poll.
+ *---------------------------------------------------------------------------*/
+    bool ready[NCHAN];
+    bool done, held;
+
+    held = _pollUnlock();
+    for (int ch=0; ch<NCHAN; ch++) {
+        _wfFree[ch].wait();
+    }
+    _pollRelock(held);
+
+    done = fetchWaveforms(ready);
+
+    for (int ch=0; ch<NCHAN; ch++) {
+        if (done && ready[ch]) {
+            if (pipe) {
+                _ppq->send(&ch, sizeof(ch));
+                continue;
+            }
+            procWaveform(ch);
+        }
+        _wfFree[ch].signal();
+    }
+
+    if (done) {
+        _batchFails = 0;
+    } else if (++_batchFails >= BATCH_FAILS) {
+        _batchFails = 0;
+        _batch = 0;
+        setIntegerParam(_boBatch, 0);
+        message("Batched trace fetch failed, BO_BATCH turned off");
+    }
+    return done;
+}
+
+
+epicsTimeStamp* drvScope::_stageMark() {
+/*-----------------------------------------------------------------------------
+ * Returns the stage mark of the calling thread.  Stages are timed in the
+ * poller thread and, in pipelined mode, in the processing thread.
+ *---------------------------------------------------------------------------*/
+    return (epicsThreadGetIdSelf() == _procTid) ? &_procT : &_stageT;
+}
+
+
+void drvScope::stageTime(int stage, int npts) {
+/*-----------------------------------------------------------------------------
+ * Records the time elapsed since the previous mark as one sample for stage,
+ * which processed npts data points, and marks the start of the next stage.
+ *---------------------------------------------------------------------------*/
+    epicsTimeStamp now;
+    epicsTimeStamp* pt = _stageMark();
+    double dt;
+
+    if ((stage < 0) || (stage >= NSTAGES)) return;
+
+    epicsTimeGetCurrent(&now);
+    dt = epicsTimeDiffInSeconds(&now, pt);
+    *pt = now;
+
+    _statLock.lock();
+    stageStat_t* ps = &_stages[stage];
+    ps->t[ps->ix] = dt;
+    ps->ix = (ps->ix + 1) % NSTATS;
+    if (ps->n < NSTATS) ps->n++;
+    ps->total += dt;
+    ps->points += npts;
+    _statLock.unlock();
+}
+
+
+void drvScope::stagePoints(int stage, int npts) {
+/*-----------------------------------------------------------------------------
+ * Adds npts data points to stage, for stages where the number of points is
+ * only known after the stage time was recorded.
+ *---------------------------------------------------------------------------*/
+    if ((stage < 0) || (stage >= NSTAGES)) return;
+
+    _statLock.lock();
+    _stages[stage].points += npts;
+    _statLock.unlock();
+}
+
+
+void drvScope::timingReset() {
+/*-----------------------------------------------------------------------------
+ * Clears the per-stage timing statistics.
+ *---------------------------------------------------------------------------*/
+    _statLock.lock();
+    memset(_stages, 0, sizeof(_stages));
+    _statLock.unlock();
+    epicsTimeGetCurrent(&_stageT);
+}
+
+
+void drvScope::timingReport(FILE* fp) {
+/*-----------------------------------------------------------------------------
+ * Prints per-stage trace acquisition timing: number of samples, median, 99th
+ * percentile and maximum time over the last NSTATS samples, and the number of
+ * data points processed per second of stage time.
+ *---------------------------------------------------------------------------*/
+    std::vector<double> t;
+    stageStat_t st;
+
+    fprintf(fp, "%s: trace acquisition timing for port %s, %s conversion\n",
+            driverName.c_str(), portName, wfConvertKernel());
+    fprintf(fp, "  %-10s %8s %10s %10s %10s %12s\n",
+            "stage", "samples", "p50 (ms)", "p99 (ms)", "max (ms)", "points/s");
+
+    for (int i=0; i<NSTAGES; i++) {
+        _statLock.lock();
+        st = _stages[i];
+        _statLock.unlock();
+
+        if (!st.n) {
+            fprintf(fp, "  %-10s %8d\n", stageNames[i], 0);
+            continue;
+        }
+
+        t.assign(st.t, st.t + st.n);
+        std::sort(t.begin(), t.end());
+
+        fprintf(fp, "  %-10s %8d %10.3f %10.3f %10.3f %12.4g\n", stageNames[i], st.n,
+                1000.0*t[(int)(0.50*(st.n-1) + 0.5)],
+                1000.0*t[(int)(0.99*(st.n-1) + 0.5)],
+                1000.0*t[st.n-1],
+                (st.total > 0.0) ? st.points/st.total : 0.0);
+    }
+
+    fprintf(fp, "  traces: time=%.3f ms, min=%.3f ms, max=%.3f ms, rate=%.2f Hz\n",
+            1000.0*_wfTime, 1000.0*_wfTMin, 1000.0*_wfTMax, _wfRate);
+    fprintf(fp, "  link: %.4g bytes/s, timeouts: control %.2f s, bulk %.2f s, last block %.2f s\n",
+            _linkBps, _tmoCtl, _tmoBulk, _blkTmo);
+}
+
+
+void drvScope::report(FILE* fp, int details) {
+/*-----------------------------------------------------------------------------
+ * This method overrides the virtual method in asynPortDriver.  Adds the
+ * trace acquisition timing when details > 0.
+ *---------------------------------------------------------------------------*/
+    asynPortDriver::report(fp, details);
+    if (details > 0) {
+        fprintf(fp, "%s: %d resync(s) of port %s\n", driverName.c_str(), _resyncs, portName);
+        fprintf(fp, "%s: %d hung exchange(s), worst recovery %.2f s\n", driverName.c_str(),
+                _wdTrips, _recovMax);
+        fprintf(fp, "%s: %d request(s) queued, %d merged, %d dropped, %d waiting, %d run between transfers\n",
+                driverName.c_str(), _mqSent, _mqMerged, _mqFailed, _pmq->pending(), _preempts);
+        fprintf(fp, "%s: acquisition count %d, %d stale poll(s) not read\n", driverName.c_str(),
+                _acqNum, _wfSkips);
+        if (_capFile) {
+            fprintf(fp, "%s: capturing to %s, %u record(s)\n", driverName.c_str(),
+                    _capName.c_str(), _capRecs);
+        }
+        timingReport(fp);
+    }
+}
+
+
 void drvScope::_errUpdate() {
 /*-----------------------------------------------------------------------------
  * Requests update from Error and Status registers.
@@ -1725,69 +3916,165 @@ void drvScope::_getChanOn(int ch) {
  * Requests read channel on state and other channel parameters as needed.
  *---------------------------------------------------------------------------*/
     const std::string functionName = "_getChanOn";
-    static bool first[] = {true, true, true, true};
-    int addr = ch-1, val;
+    int addr = ch-1;
+    bool on;
     double dval;
 
     asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: ch=%d\n",
             driverName.c_str(), functionName.c_str(), ch);
 
     getInt(ixBoChOn, _boChOn, ch);
+
+    batchBegin();
+    on = _getChanParams(ch);
+    batchFlush();
+
+    getDoubleParam(addr, _aoChPos, &dval);
+    if (on && (addr == _chSel)) {
+        _setPosSlider(dval);
+    }
+}
+
+
+bool drvScope::_getChanParams(int ch) {
+/*-----------------------------------------------------------------------------
+ * Queues the queries for the parameters of channel ch, once its on state has
+ * been read.  These are skipped for a channel that is off, except the first
+ * time.  Returns true when they were queued.
+ *---------------------------------------------------------------------------*/
+    static bool first[] = {true, true, true, true};
+    int addr = ch-1, val;
+
     _selectChannel();
 
     getIntegerParam(addr ,_boChOn, &val);
-    if ((!val) && (!first[addr])) return;
+    if ((!val) && (!first[addr])) return false;
     first[addr] = false;
 
-    getEnum(ixBoChImp, _boChImp, ch);
-    getEnum(ixMbboChCpl, _mbboChCpl, ch);
-    getFloat(ixAoChScl, _aoChScl, ch);
+    batchEnum(ixBoChImp, _boChImp, ch);
+    batchEnum(ixMbboChCpl, _mbboChCpl, ch);
+    batchFloat(ixAoChScl, _aoChScl, ch);
     getChanScl(ch);
     getChanPos(addr);
-    getDoubleParam(addr, _aoChPos, &dval);
-    if (addr == _chSel) {
-        _setPosSlider(dval);
-    }
+    return true;
 }
 
 
 void drvScope::update() {
 /*----------------------------------------------------------------------------
  * This is called at startup and periodically to stay in sync with user
- * changing settings on the instrument.
+ * changing settings on the instrument.  The queries are batched in two
+ * rounds, the channel parameters need the channel on states of the first.
+ * When the driver can take a snapshot of all settings, the queries it
+ * covers are answered from that.
  *--------------------------------------------------------------------------*/
     const std::string functionName = "update";
-    int ch;
+    bool on[NCHAN];
     double dval;
 
     asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s\n",
             driverName.c_str(), functionName.c_str());
 
-    getFloat(ixAiTimDiv, _aiTimDiv);
+    _useSnap = canSnapshot() && _takeSnapshot();
+
+    batchBegin();
+    batchFloat(ixAiTimDiv, _aiTimDiv);
+    updateUser();
+    for (int i=0; i<NCHAN; i++) {
+        batchInt(ixBoChOn, _boChOn, i+1);
+    }
+    batchFloat(ixAoTimDly, _aoTimDly);
+    batchInt(ixBoTimDlySt, _boTimDlySt);
+    batchFloat(ixAoTrPos, _aoTrPos);
+    batchFloat(ixAoTrLev, _aoTrLev);
+    batchFloat(ixAoTrHOff, _aoTrHOff);
+    batchFlush();
+
     getDoubleParam(_aiTimDiv, &dval);
     setTimePerDiv(dval);
-    updateUser();
+    getDoubleParam(_aoTimDly, &dval);
+    timeDelayStr(dval);
+
+    batchBegin();
+    for (int i=0; i<NCHAN; i++) {
+        on[i] = _getChanParams(i+1);
+    }
+    batchFlush();
 
     for (int i=0; i<NCHAN; i++) {
-        ch = i+1;
-        _getChanOn(ch);
+        getDoubleParam(i, _aoChPos, &dval);
+        if (on[i] && (i == _chSel)) {
+            _setPosSlider(dval);
+        }
         callParamCallbacks(i);
     }
 
-    getFloat(ixAoTimDly, _aoTimDly);
-    getDoubleParam(_aoTimDly, &dval);
-    timeDelayStr(dval);
-    getInt(ixBoTimDlySt, _boTimDlySt);
-    getFloat(ixAoTrPos, _aoTrPos);
-    getFloat(ixAoTrLev, _aoTrLev);
+    _useSnap = false;
+
     getTrigLevl();
-    getFloat(ixAoTrHOff, _aoTrHOff);
     callParamCallbacks();
+    _checkPreambles();
+}
+
+
+void drvScope::invalidatePreambles() {
+/*-----------------------------------------------------------------------------
+ * Marks all cached waveform preambles as stale.  Drivers that cache the
+ * preamble keep the preambleGen() value it was read at, and read it again
+ * when that has changed.
+ *---------------------------------------------------------------------------*/
+    _preGen++;
+}
+
+
+bool drvScope::changesPreamble(int ix) {
+/*-----------------------------------------------------------------------------
+ * Returns true when writing the integer parameter ix may change a waveform
+ * preamble, so that the cached ones are read again: channel on, position,
+ * record length and window, and the actions that load a whole setup.
+ * Drivers add their scale, timebase and data format settings.  Actions such
+ * as GETWF or a channel select leave the cache, and the traces, alone.
+ *---------------------------------------------------------------------------*/
+    return (ix == _boChOn) || (ix == _loChPos) || (ix == _loWfNpts) ||
+           (ix == _loWfStart) || (ix == _loWfStop) || (ix == _boReset) ||
+           (ix == _boInit) || (ix == _boRestore);
+}
+
+
+void drvScope::_checkPreambles() {
+/*-----------------------------------------------------------------------------
+ * Invalidates the cached preambles when a setting they depend on reads back
+ * different from last time, e.g. after a change on the scope's front panel.
+ *---------------------------------------------------------------------------*/
+    std::string key;
+    char str[64];
+    double scl, pos, tdiv;
+    int npts, start, stop;
+
+    getDoubleParam(_aiTimDiv, &tdiv);
+    getIntegerParam(_loWfNpts, &npts);
+    getIntegerParam(_loWfStart, &start);
+    getIntegerParam(_loWfStop, &stop);
+    sprintf(str, "%g %d %d %d", tdiv, npts, start, stop);
+    key = str;
+    for (int i=0; i<NCHAN; i++) {
+        getDoubleParam(i, _aoChScl, &scl);
+        getDoubleParam(i, _aoChPos, &pos);
+        sprintf(str, " %g %g", scl, pos);
+        key += str;
+    }
+
+    if (key != _preKey) {
+        _preKey = key;
+        invalidatePreambles();
+    }
 }
 
 
 void drvScope::afterInit() {
 /*----------------------------------------------------------------------------
+ * Runs in the poller thread before polling starts.  Settings are read by
+ * update() and one more batch, the string replies are queued.
  *--------------------------------------------------------------------------*/
     const std::string functionName = "afterInit";
     asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s\n",
@@ -1799,24 +4086,138 @@ void drvScope::afterInit() {
 
     putInMessgQ(enQuery, _wfIdn, 0, 0);
     putInMessgQ(enQuery, _siIpAddr, 0, 0);
+    putInMessgQ(enQuery, _siWfFmt, 0, 0);
+    putInMessgQ(enQuery, _siOpc, 0, 0);
 
-    for (int i=0; i<NCHAN; i++) {
-        putInMessgQ(enQuery, _boChOn, i, 0);
+    batchBegin();
+    batchInt(ixLoWfNpts, _loWfNpts);
+    batchInt(ixLoWfStart, _loWfStart);
+    batchInt(ixLoWfStop, _loWfStop);
+    batchInt(ixLiEsr, _liEsr);
+    batchInt(ixLoEse, _loEse);
+    batchInt(ixLiStb, _liStb);
+    batchFlush();
+
+    update();
+}
+
+
+// Diagnostic routines.  Called directly, or from the iocsh function below
+extern "C" {
+
+int drvScopeTiming(const char* port, int reset) {
+/*-----------------------------------------------------------------------------
+ * EPICS iocsh callable function to print the trace acquisition timing of a
+ * scope driver.
+ *  port  The name of the scope asyn port.
+ *  reset When non-zero, clear the statistics after printing them.
+ *---------------------------------------------------------------------------*/
+    drvScope* pscope = drvScope::find(port);
+
+    if (!pscope) {
+        errlogPrintf("%s::drvScopeTiming: %s is not a scope port\n", driverName.c_str(), port);
+        return asynError;
     }
 
-    putInMessgQ(enQuery, _aoTimDly, 0, 0);
-    putInMessgQ(enQuery, _aiTimDiv, 0, 0);
-    putInMessgQ(enQuery, _aoTrPos, 0, 0);
-    putInMessgQ(enQuery, _aoTrLev, 0, 0);
-    putInMessgQ(enQuery, _aoTrHOff, 0, 0);
-    putInMessgQ(enQuery, _siWfFmt, 0, 0);
-    putInMessgQ(enQuery, _siOpc, 0, 0);
-    putInMessgQ(enQuery, _loWfNpts, 0, 0);
-    putInMessgQ(enQuery, _loWfStart, 0, 0);
-    putInMessgQ(enQuery, _loWfStop, 0, 0);
-    putInMessgQ(enQuery, _liEsr, 0, 0);
-    putInMessgQ(enQuery, _loEse, 0, 0);
-    putInMessgQ(enQuery, _liStb, 0, 0);
-    putInMessgQ(enQuery, _aoTrLev, 0, 0);
+    pscope->timingReport(stdout);
+    if (reset) pscope->timingReset();
+    return asynSuccess;
+}
+
+/* EPICS iocsh shell commands */
+static const iocshArg timingArg0 = {"port", iocshArgString};
+static const iocshArg timingArg1 = {"reset", iocshArgInt};
+static const iocshArg * const timingArgs[] = {&timingArg0, &timingArg1};
+static const iocshFuncDef timingFuncDef = {"drvScopeTiming", 2, timingArgs};
+static void timingCallFunc(const iocshArgBuf *args){
+    drvScopeTiming(args[0].sval, args[1].ival);
+}
+
+int drvScopeBulkConfigure(const char* port, const char* hostport, int rcvbuf) {
+/*-----------------------------------------------------------------------------
+ * EPICS iocsh callable function to read block replies, traces, of a scope
+ * driver over a socket of their own instead of the asyn port.
+ *  port      The name of the scope asyn port.
+ *  hostport  "host:port" of the instrument's raw socket server.
+ *  rcvbuf    Socket receive buffer size in bytes, 0 for the default.
+ *---------------------------------------------------------------------------*/
+    drvScope* pscope = drvScope::find(port);
+
+    if (!pscope) {
+        errlogPrintf("%s::drvScopeBulkConfigure: %s is not a scope port\n", driverName.c_str(), port);
+        return asynError;
+    }
+
+    return pscope->bulkConfigure(hostport, rcvbuf);
+}
+
+static const iocshArg bulkArg0 = {"port", iocshArgString};
+static const iocshArg bulkArg1 = {"host:port", iocshArgString};
+static const iocshArg bulkArg2 = {"rcvbuf", iocshArgInt};
+static const iocshArg * const bulkArgs[] = {&bulkArg0, &bulkArg1, &bulkArg2};
+static const iocshFuncDef bulkFuncDef = {"drvScopeBulkConfigure", 3, bulkArgs};
+static void bulkCallFunc(const iocshArgBuf *args){
+    drvScopeBulkConfigure(args[0].sval, args[1].sval, args[2].ival);
+}
+
+int drvScopeTimeouts(const char* port, double ctl, double bulk) {
+/*-----------------------------------------------------------------------------
+ * EPICS iocsh callable function to set the timeout floors of a scope driver.
+ *  port  The name of the scope asyn port.
+ *  ctl   Timeout of control exchanges in seconds, 0 to keep the default.
+ *  bulk  Least timeout of block exchanges in seconds, 0 to keep the default.
+ *---------------------------------------------------------------------------*/
+    drvScope* pscope = drvScope::find(port);
+
+    if (!pscope) {
+        errlogPrintf("%s::drvScopeTimeouts: %s is not a scope port\n", driverName.c_str(), port);
+        return asynError;
+    }
+
+    pscope->setTimeouts(ctl, bulk);
+    return asynSuccess;
+}
+
+static const iocshArg tmoArg0 = {"port", iocshArgString};
+static const iocshArg tmoArg1 = {"control", iocshArgDouble};
+static const iocshArg tmoArg2 = {"bulk", iocshArgDouble};
+static const iocshArg * const tmoArgs[] = {&tmoArg0, &tmoArg1, &tmoArg2};
+static const iocshFuncDef tmoFuncDef = {"drvScopeTimeouts", 3, tmoArgs};
+static void tmoCallFunc(const iocshArgBuf *args){
+    drvScopeTimeouts(args[0].sval, args[1].dval, args[2].dval);
+}
+
+int drvScopeCapture(const char* port, const char* file) {
+/*-----------------------------------------------------------------------------
+ * EPICS iocsh callable function to record the I/O of a scope driver for
+ * drvScopeReplayConfigure.
+ *  port  The name of the scope asyn port.
+ *  file  The capture file, empty to stop the capture.
+ *---------------------------------------------------------------------------*/
+    drvScope* pscope = drvScope::find(port);
+
+    if (!pscope) {
+        errlogPrintf("%s::drvScopeCapture: %s is not a scope port\n", driverName.c_str(), port);
+        return asynError;
+    }
+
+    return pscope->capture(file);
+}
+
+static const iocshArg capArg0 = {"port", iocshArgString};
+static const iocshArg capArg1 = {"file", iocshArgString};
+static const iocshArg * const capArgs[] = {&capArg0, &capArg1};
+static const iocshFuncDef capFuncDef = {"drvScopeCapture", 2, capArgs};
+static void capCallFunc(const iocshArgBuf *args){
+    drvScopeCapture(args[0].sval, args[1].sval);
+}
+
+void drvScopeRegister(void) {
+    iocshRegister(&timingFuncDef, timingCallFunc);
+    iocshRegister(&bulkFuncDef, bulkCallFunc);
+    iocshRegister(&tmoFuncDef, tmoCallFunc);
+    iocshRegister(&capFuncDef, capCallFunc);
 }
 
+epicsExportRegistrar(drvScopeRegister);
+}
@@ -6,8 +6,17 @@
  * asynPortDriver --> drvScope
  *---------------------------------------------------------------------------*/
 
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <epicsEvent.h>
 #include <epicsMessageQueue.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
 #include <epicsTimer.h>
+#include <osiSock.h>
 #include "asynPortDriver.h"
 
 #ifndef SIZE
@@ -28,13 +37,33 @@
 #define CMND_LEN    32
 #define DBUF_LEN    10240
 #define FNAME       128
+#define NSTATS      1000    // samples kept per stage for timing statistics
+#define BLK_MAXHDR  4096    // max text before the '#' of a binary block
+#define QBATCH_LEN  240     // max length of a compound query, see batchFlush()
+#define RESYNC_READS 5      // reads to wait for the marker reply, see _resync()
+#define BATCH_FAILS 3       // batched fetches failed in a row that turn BO_BATCH off
+#define BULK_RETRY  10.0    // seconds between bulk socket connect attempts
+#define TMO_CTL     0.5     // default control exchange timeout, s
+#define TMO_BULK    2.0     // default least block exchange timeout, s
+#define TMO_MARGIN  3.0     // block timeout over the expected transfer time
+#define RATE_WEIGHT 0.25    // weight of a new sample in the throughput average
+#define PROBE_MIN   0.5     // first probe interval while disconnected, s
+#define PROBE_MAX   30.0    // longest probe interval, s
+#define WDOG_TICK   0.25    // watchdog check interval, s
+#define WDOG_GRACE  1.0     // time an exchange may overrun its timeout, s
+#define WDOG_RECOVER 3.0    // time allowed for recovery after a hung exchange, s
+#define WDOG_DRAIN  0.1     // read timeout when draining input, s
+#define PTMAX_DEF   2.0     // default longest poll time in adaptive mode, s
 
 typedef unsigned char  byte;
 typedef unsigned short word;
 typedef unsigned int   uint;
 
 typedef enum {enTMNone, enTMASync, enTMSync} tracem_e;
-typedef enum {enPutInt, enPutFlt, enQuery} ctype_e;
+typedef enum {enPutInt, enPutFlt, enQuery, enCommand} ctype_e;
+typedef enum {enMqAdded, enMqMerged, enMqFull} mqsend_e;
+typedef enum {enMqControl, enMqBulk, NMQCLASS} mqclass_e;
+typedef enum {enStTrig, enStPre, enStXfer, enStDecode, enStCallback, NSTAGES} stage_e;
 
 typedef struct {
     int type,           // one of ctype_e (type of command processing)
@@ -42,8 +71,34 @@ typedef struct {
         addr,           // channel or address
         ival;           // possible integer set value
     float fval;         // possible floating point value
+    std::string sval;   // command string of enCommand
 } msgq_t;
 
+typedef enum {enBtInt, enBtFlt, enBtEnum} btype_e;
+
+typedef struct {
+    int type;                       // one of btype_e
+    std::string query;              // query as sent, e.g. "CH1:SCA?"
+    int pix, addr;                  // parameter library index and address
+    const char** list;              // enum keywords, or NULL when in vlist
+    int ni;                         // number of items in list
+    std::vector<std::string> vlist; // enum keywords
+} batchq_t;
+
+typedef struct {
+    std::vector<std::string> nodes; // header nodes, e.g. "CH1", "SCALE"
+    std::string value;              // value as in the snapshot
+    bool changed;                   // differs from the previous snapshot
+} setting_t;
+
+typedef struct {
+    double t[NSTATS];   // most recent stage times (s), circular
+    int    n;           // number of valid samples in t
+    int    ix;          // index of the next sample in t
+    double total;       // accumulated stage time (s)
+    double points;      // accumulated number of data points
+} stageStat_t;
+
 typedef struct{
     int pix; 
     const char* pcmd;
@@ -133,7 +188,52 @@ struct Command {
 #define aiWfPerStr        "AI_WFPER"    // get traces period
 #define aiWfRateStr       "AI_WFRATE"    // get traces rate
 #define boMeasEnabledStr  "BO_MEAS_EN"  // when true, read measurements from scope
+#define boPipeStr         "BO_PIPE"     // when true, decode traces in a worker thread
+#define boBatchStr        "BO_BATCH"    // when true, fetch all traces in one exchange
+#define aiRecovMaxStr     "AI_RECOVMAX" // worst recovery time after a hung exchange
+#define liMQDepthStr      "LI_MSGQD"    // requests waiting in the queue
+#define liMQMergedStr     "LI_MSGQM"    // requests replaced by a newer one
+#define boAdaptStr        "BO_ADAPT"    // when true, poll rate follows acquisitions
+#define aoPTMaxStr        "AO_PTMAX"    // longest poll time in adaptive mode
+#define aiPTCurStr        "AI_PTCUR"    // current poll time
+#define biIdleStr         "BI_IDLE"     // acquisition stopped, traces not read
+#define liAcqCntStr       "LI_ACQCNT"   // acquisition count of the scope, -1 unknown
+#define biNewDataStr      "BI_NEWDATA"  // the traces are from a new acquisition
+
+
+class drvScope;
+
+// Request queue of the poller, see putInMessgQ().  A request for the same
+// parameter and address as one still waiting replaces it, so only the last
+// value goes to the instrument.  Requests that are not merged are never
+// merged over either, and there may be up to nmax of them.  Control
+// requests are taken before bulk ones, see mqclass_e.
+class scopeQueue {
+public:
+    scopeQueue(int nmax): _nmax(nmax) {}
+    int           send(const msgq_t& msg, bool merge, int cls=enMqControl);
+    bool          receive(msgq_t* msg, double tmo, int cls=enMqBulk);
+    int           pending();
+private:
+    typedef std::pair<int, std::pair<int,int> > key_t;
+    typedef std::list<msgq_t>::iterator  pos_t;
+    static key_t  _key(const msgq_t& msg);
+    bool          _take(msgq_t* msg, int cls);
+    std::list<msgq_t>    _order[NMQCLASS]; // requests of each class in the order they are taken
+    std::map<key_t,pos_t> _pending;     // requests that a newer one may replace
+    epicsMutex    _lock;
+    epicsEvent    _event;
+    int           _nmax;
+};
 
+// Expiry of the I/O watchdog timer, see drvScope::watchdog()
+class scopeWatchdog: public epicsTimerNotify {
+public:
+    scopeWatchdog(drvScope* pscope): _pscope(pscope) {}
+    expireStatus expire(const epicsTime&);
+private:
+    drvScope* _pscope;
+};
 
 class drvScope: public asynPortDriver,
                 private epicsTimerNotify {
@@ -141,17 +241,29 @@ public:
     friend class Utils;
     drvScope(const char* port, const char* udp);
     virtual ~drvScope();
+    static drvScope* find(const char* port);
 
     virtual asynStatus writeOctet(asynUser* pau, const char* val, size_t nc, size_t* nActual);
     virtual asynStatus writeInt32(asynUser* pau,epicsInt32 v);
     virtual asynStatus writeFloat64(asynUser* pau,epicsFloat64 v);
+    virtual void report(FILE* fp, int details);
     void pollerThread();
+    void procThread();
+    bool watchdog();
+    void timingReport(FILE* fp);
+    void timingReset();
+    asynStatus bulkConfigure(const char* hostport, int rcvbuf);
+    void setTimeouts(double ctl, double bulk);
+    asynStatus capture(const char* file);
     void setChanPosition();
     virtual const char*  getCommand(int ix) {return NULL;}
     virtual const char** getCmndList(int cix, uint* ni) {*ni = 0; return NULL;}
     virtual const std::vector<std::string> getKeywordList(int cix) const {return std::vector<std::string>();}
     virtual void afterInit() = 0;
     virtual void getWaveform(int ch) = 0;
+    virtual bool fetchWaveform(int ch) {getWaveform(ch); return false;}
+    virtual void procWaveform(int ch) {}
+    virtual bool fetchWaveforms(bool* ready) {return false;}
     virtual void getHSParams(double hs, int* x0, int* np) {*x0 = 0; *np = 500;}
     virtual void getChanPos(int addr);
     virtual void setChanPos(int addr, double v);
@@ -159,6 +271,8 @@ public:
     virtual void restoreConfig();
     virtual bool isTriggered() {return true;}
     virtual bool isRunning() {return true;}
+    virtual int getAcqCount() {return -1;}
+    virtual bool changesPreamble(int ix);
     epicsTimerNotify::expireStatus expire(const epicsTime&) {setChanPosition(); return noRestart;}
 
 protected:
@@ -175,7 +289,10 @@ protected:
         _wfEvent,    _wfMessg,    _boChSel,    _loChPos,    _loTrLev,
         _liMsgQS,    _liMsgQF,    _mbboTracMod,_liXNpts,    _biState,
         _boErUpdt,   _wfFPath,    _boRestore,  _boRdTraces, _aiWfTime,
-        _aiWfTMin,   _aiWfTMax,   _aiWfPeriod, _aiWfRate, _boMeasEnabled;
+        _aiWfTMin,   _aiWfTMax,   _aiWfPeriod, _aiWfRate, _boMeasEnabled,
+        _boPipe,     _boBatch,    _aiRecovMax, _liMsgQD,    _liMsgQM,
+        _boAdapt,    _aoPTMax,    _aiPTCur,    _biIdle,     _liAcqCnt,
+        _biNewData;
 
     enum {ixBoChOn,     ixAoChPos,    ixBoChImp,    ixMbboChCpl,  ixAoChScl,
          ixWfTrace,    ixLoWfNpts,   ixLoWfStart,  ixLoWfStop,   ixSiWfFmt,
@@ -190,7 +307,10 @@ protected:
          ixWfEvent,    ixWfMessg,    ixBoChSel,    ixLoChPos,    ixLoTrLev,
          ixLiMsgQS,    ixLiMsgQF,    ixMbboTracMod,ixLiXNpts,    ixBiState,
          ixBoErUpdt,   ixWfFPath,    ixBoRestore,  ixBoRdTraces, ixAiWfTime,
-         ixAiWfTMin,   ixAiWfTMax,   ixAiWfPeriod, ixAiWfRate,   ixBoMeasEnabled};
+         ixAiWfTMin,   ixAiWfTMax,   ixAiWfPeriod, ixAiWfRate,   ixBoMeasEnabled,
+         ixBoPipe,     ixBoBatch,    ixAiRecovMax, ixLiMsgQD,    ixLiMsgQM,
+         ixBoAdapt,    ixAoPTMax,    ixAiPTCur,    ixBiIdle,     ixLiAcqCnt,
+         ixBiNewData};
 
     virtual asynStatus putFltCmnds(int ix, int addr, float v);
     virtual asynStatus putIntCmnds(int ix, int addr, int v);
@@ -201,12 +321,19 @@ protected:
     virtual void setTrigLevl(int v) = 0;
     virtual void timeDelayStr(int m, int uix) = 0;
     virtual void updateUser() {};
+    virtual bool canBatch() {return false;}
+    virtual bool canSnapshot() {return false;}
+    virtual bool isAction(int ix);
+    int           requestClass(int type, int ix);
     virtual void getMeasurements(int pollCount) {};
 
-    void          putInMessgQ(int tp, int ix, int addr, int iv, float fv=0.0);
+    void          putInMessgQ(int tp, int ix, int addr, int iv, float fv=0.0, const char* sv=NULL);
     void          message(const std::string msg);
     asynStatus    writeRd(int cix, int ch, char* buf, int blen);
     asynStatus    writeRd(const char* cmnd, char* buf, int blen);
+    asynStatus    writeRdBlock(int cix, int ch, std::string& pre, std::vector<char>& blk);
+    asynStatus    writeRdBlock(const char* cmnd, std::string& pre, std::vector<char>& blk);
+    asynStatus    writeRdBlocks(const char* cmnd, std::string& pre, std::vector<char>** blks, int nblk);
     asynStatus    command(const char* cmnd);
     asynStatus    command(const char* cmnd, char* prd, int len);
     asynStatus    getInt(int cix, int pix, int ch=0);
@@ -223,9 +350,24 @@ protected:
     virtual void setEnum(const char* cmnd, int val, std::vector<std::string> list, int ch=0);
     asynStatus    getString(int cix, int pix);
     asynStatus    getString(const char* cmnd, int pix);
+    void          batchBegin();
+    asynStatus    batchFlush();
+    void          batchInt(int cix, int pix, int ch=0);
+    void          batchInt(const char* cmnd, int pix, int ch=0);
+    void          batchFloat(int cix, int pix, int ch=0);
+    void          batchFloat(const char* cmnd, int pix, int ch=0);
+    void          batchEnum(int cix, int pix, int ch=0);
+    void          batchEnum(const char* cmnd, int pix, std::vector<std::string> list, int ch=0);
     void          timeDelayStr(float td);
     void          update();
     void          setConnectedState(int state);
+    void          stageMark();
+    void          stageTime(int stage, int npts=0);
+    void          stagePoints(int stage, int npts);
+    void          invalidatePreambles();
+    int           preambleGen() const {return _preGen;}
+    void          desync();
+    void          expectBlock(size_t nbytes);
 
     asynUser*     pasynUser;
     int           _analize[NCHAN];    // analysis on/off flags
@@ -238,21 +380,75 @@ protected:
     long          _err_count;
 
 private:
-    epicsMessageQueue* _pmq;
+    scopeQueue*   _pmq;
+    epicsMessageQueue* _ppq;        // channels fetched, waiting for procWaveform
     void          _evMessage();
+    void          _probe();
+    void          _request(msgq_t* pm);
+    bool          _pollUnlock();
+    void          _pollRelock(bool held);
+    bool          _canPreempt();
+    void          _preempt();
+    void          _acqSample();
+    bool          _acqDue();
+    bool          _tracesNew();
+    void          _recover();
+    void          _wdArm(double tmo);
+    void          _wdDisarm();
     asynStatus    _write(const char* pw, size_t nw);
-    asynStatus    _wtrd(const char* pw, size_t nw, char* pr, size_t nr);
+    void          _writeBehindBegin();
+    asynStatus    _writeBehindFlush();
+    void          _joinCmnd(std::string& msg, const char* pw, size_t nw);
+    const char*   _withPending(const char* pw, size_t* nw);
+    asynStatus    _wtrd(const char* pw, size_t nw, char* pr, size_t nr, double tmo=0.0);
+    asynStatus    _wtrdBlock(const char* pw, size_t nw, std::string& pre,
+                             std::vector<char>** blks, int nblk);
+    asynStatus    _wtrdText(const char* pw, size_t nw, std::string& reply);
+    bool          _resync();
+    double        _blockTimeout();
+    void          _linkRate(epicsTimeStamp* t0, size_t nbytes);
+    asynStatus    _blkWriteRead(const char* pw, size_t nw, char* pr, size_t nr, double tmo,
+                                size_t* nbw, size_t* nbr, int* eom);
+    asynStatus    _blkRead(char* pr, size_t nr, double tmo, size_t* nbr, int* eom);
+    void          _blkDesync();
+    bool          _bulkConnect();
+    void          _bulkClose();
+    asynStatus    _ioWrite(const char* pw, size_t nw, double tmo, size_t* nbw);
+    asynStatus    _ioWriteRead(const char* pw, size_t nw, char* pr, size_t nr, double tmo,
+                               size_t* nbw, size_t* nbr, int* eom);
+    asynStatus    _ioRead(char* pr, size_t nr, double tmo, size_t* nbr, int* eom);
+    void          _ioFlush();
+    double        _wdClamp(double tmo);
+    bool          _wdCheck();
+    void          _capture(int type, epicsTimeStamp* t, asynStatus status, int eom,
+                           const char* p, size_t n);
+    void          _ioResult(bool ok, const char* fn, asynStatus status, const char* pw,
+                            size_t nbw, size_t nbr);
     int           _opc();
     char*         _makeQuery(const char* cmnd);
     const char*   _getCmnd(int pix);
     void          _getIdn();
     void          _getIpAddr();
     void          _setTimeDelayStr(float v);
-    void          _getTraces();
+    void          _getTraces(bool pipe=false);
+    bool          _getTracesBatch(bool pipe);
+    void          _checkPreambles();
+    epicsTimeStamp* _stageMark();
     int           _find(const char* item, const char** list, int n);
     int           _find(const char* item, std::vector<std::string> list);
     void          _errUpdate();
+    void          _batchAdd(int type, const char* cmnd, int pix, int ch,
+                            const char** list=NULL, int ni=0,
+                            std::vector<std::string> vlist=std::vector<std::string>());
+    asynStatus    _batchQuery(const std::string& query, size_t i0, size_t i1);
+    asynStatus    _batchSet(batchq_t* pq, char* val);
+    void          _batchFromSnapshot();
+    bool          _takeSnapshot();
+    int           _parseSnapshot(const std::string& str);
+    setting_t*    _findSetting(const std::string& query);
+    bool          _nodeMatch(const std::string& a, const std::string& b);
     void          _getChanOn(int ch);
+    bool          _getChanParams(int ch);
     void          _setPosSlider(double v);
     void          _selectChannel();
     void          _selectChan(int ch);
@@ -272,6 +468,8 @@ private:
     double        _chPos;        // trace position from slider
     int           _mqSent;
     int           _mqFailed;
+    int           _mqMerged;
+    bool          _mqFull;          // the last request did not fit in the queue
     int           _tracemode;        // 0 async, 1 sync
     int           _rdtraces;        // read traces flag
     int           _posInProg;        // when true position slider moving
@@ -281,9 +479,76 @@ private:
     double        _wfPeriod;
     double        _wfRate;
     int           _measEnabled;
+    int           _pipeline;        // fetch and process traces in separate threads
+    int           _batch;           // fetch all traces in one exchange
+    int           _batchFails;      // batched fetches failed in a row
+    int           _adapt;           // poll time follows acquisitions, see _acqDue()
+    double        _pollTMax;        // longest poll time in adaptive mode
+    double        _pollTCur;        // current poll time in adaptive mode
+    int           _acqLast;         // acquisition count at the last read, -1 unknown
+    bool          _acqForce;        // read at the next poll, a setting was changed
+    bool          _acqIdle;         // acquisition is stopped and traces were read
+    int           _acqNum;          // acquisition count at this poll, -1 unknown
+    bool          _acqRun;          // run state at this poll, see _acqSample()
+    int           _wfAcq;           // _acqNum when the traces were last read
+    int           _wfGen;           // preambleGen() when the traces were last read
+    bool          _wfStopped;       // the traces were last read while stopped
+    int           _wfSkips;         // polls the traces were not read, see _tracesNew()
+    volatile int  _preGen;          // preamble generation, see invalidatePreambles()
+    bool          _opcPending;      // a write may still be executing, see _opc()
+    bool          _desync;          // replies may be out of step, see _resync()
+    int           _resyncs;         // number of resyncs, the first at startup
+    bool          _writeBehind;     // writes are held in _wbCmnds, see _writeBehindBegin()
+    std::string   _wbCmnds;         // held set commands
+    std::string   _wbMsg;           // held commands joined with a query
+    SOCKET        _bulkSock;        // socket for block replies, see bulkConfigure()
+    std::string   _bulkHost;        // its "host:port", empty when not configured
+    int           _bulkRcvBuf;      // its SO_RCVBUF, 0 for the default
+    epicsTimeStamp _bulkRetry;      // no connect attempt before this time
+    double        _bulkTmo;         // SO_RCVTIMEO of the bulk socket
+    double        _tmoCtl;          // control exchange timeout
+    double        _tmoBulk;         // least block exchange timeout
+    double        _linkBps;         // moving average of block throughput, bytes/s
+    double        _blkTmo;          // timeout of the last block exchange
+    size_t        _blkExpect;       // size of the next block reply, see expectBlock()
+    size_t        _blkLast;         // size of the last block reply
+    bool          _disconnected;    // polling stops, see _probe()
+    double        _probeWait;       // interval to the next probe
+    epicsMutex    _capLock;         // protects the capture state below
+    FILE*         _capFile;         // capture of all I/O, see capture()
+    std::string   _capName;         // its file name
+    epicsTimeStamp _capStart;       // time origin of the capture
+    unsigned      _capRecs;         // records written
+    scopeWatchdog _wdNotify;
+    epicsTimer*   _wdTimer;         // cancels hung exchanges, see watchdog()
+    epicsMutex    _wdLock;          // protects the watchdog state and _bulkSock
+    bool          _wdActive;        // an exchange is in flight
+    volatile bool _wdFired;         // an exchange was cancelled, see _recover()
+    epicsTimeStamp _wdStart;        // start of the exchange in flight
+    epicsTimeStamp _wdDeadline;     // when it is cancelled
+    epicsTimeStamp _wdHung;         // start of the cancelled exchange
+    int           _wdTrips;         // number of cancelled exchanges
+    asynUser*     _pasynCommon;     // the I/O port, disconnected by _recover()
+    double        _recovMax;        // worst recovery time, s
+    bool          _batching;        // queries are being collected, see batchBegin()
+    std::vector<batchq_t> _batchQ;  // collected queries
+    bool          _useSnap;         // batched queries are answered from _snap
+    int           _snapGen;         // preambleGen() at the previous snapshot
+    std::vector<setting_t> _snap;   // settings from the last SET?
+    std::map<std::string, std::string> _snapOld;  // previous snapshot, by header
+    std::string   _preKey;          // settings the preambles were read with
     int           _pollCount;
     epicsTimerQueueActive* _timerQueue;
     epicsTimer*   _chPosTimer;
+    epicsMutex    _statLock;        // protects _stages
+    stageStat_t   _stages[NSTAGES]; // per-stage trace acquisition timing
+    epicsTimeStamp _stageT;         // end of the previous stage
+    epicsTimeStamp _procT;          // same, for the processing thread
+    epicsThreadId _procTid;
+    epicsThreadId _pollTid;
+    bool          _inBulk;          // bulk work in progress that _preempt() may interrupt
+    int           _preempts;        // control requests run by _preempt()
+    epicsEvent    _wfFree[NCHAN];   // trace buffer of the channel may be refilled
 };
 
 #endif    // DRVSCOPE_H
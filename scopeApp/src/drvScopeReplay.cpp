@@ -0,0 +1,321 @@
+/* drvScopeReplay.cpp
+ * Replay transport.  An asyn octet port which plays back a file recorded
+ * with drvScopeCapture: every read returns the next recorded reply, with its
+ * status and end of message reason, and every write is checked against the
+ * next recorded write.  Replies are delayed to keep the recorded timing,
+ * scaled by speed, or returned at once when speed is 0.
+ * asynPortDriver --> drvScopeReplay
+ *
+ * Usage in st.cmd, before the scope driver is configured:
+ *   drvScopeReplayConfigure("RPL", "/tmp/tds.cap", 0, 1)
+ *   drvTDSConfigure("SCOPE", "RPL")
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <epicsTime.h>
+#include <epicsThread.h>
+#include <epicsStdio.h>
+#include <errlog.h>
+#include <epicsExport.h>
+#include <iocsh.h>
+
+#include "drvScopeReplay.h"
+
+#define REPLAY_MISMATCH_PRINT  5    // mismatched writes that are printed
+#define REPLAY_SEARCH   200         // records searched for a write, see _seekWrite()
+
+namespace {
+const std::string driverName = "drvScopeReplay";
+}
+
+
+drvScopeReplay::drvScopeReplay(const char* port, const char* file, double speed, int loop):
+        asynPortDriver(port, 1,
+                asynOctetMask | asynDrvUserMask,
+                asynOctetMask,
+                ASYN_CANBLOCK, 1, 0, 0),
+                _fp(NULL),
+                _file(file ? file : ""),
+                _speed(speed),
+                _loop(loop != 0),
+                _rpos(0),
+                _have(false),
+                _c0(0.0),
+                _started(false),
+                _records(0),
+                _mismatches(0),
+                _skipped(0),
+                _passes(0) {
+/*------------------------------------------------------------------------------
+ * Constructor for the drvScopeReplay class. Calls constructor for the
+ * asynPortDriver base class.
+ *  port   The name of the asyn port to be created.
+ *  file   The capture file.
+ *  speed  Time scale: 1 for the recorded timing, 0 for no delays.
+ *  loop   Non-zero to start over at the end of the file.
+ *---------------------------------------------------------------------------*/
+    char magic[CAP_MAGIC_LEN];
+
+    if (_speed < 0.0) _speed = 0.0;
+
+    _fp = fopen(_file.c_str(), "rb");
+    if (!_fp || (fread(magic, 1, CAP_MAGIC_LEN, _fp) != CAP_MAGIC_LEN) ||
+            memcmp(magic, CAP_MAGIC, CAP_MAGIC_LEN)) {
+        errlogPrintf("%s::%s: %s is not a capture file\n",
+                driverName.c_str(), driverName.c_str(), _file.c_str());
+        if (_fp) fclose(_fp);
+        _fp = NULL;
+        return;
+    }
+
+    epicsPrintf("%s::%s: port %s replaying %s, speed=%g%s\n",
+            driverName.c_str(), driverName.c_str(), port, _file.c_str(), _speed,
+            _loop ? ", looping" : "");
+}
+
+
+drvScopeReplay::~drvScopeReplay() {
+/*-----------------------------------------------------------------------------
+ * Destructor, closes the capture file.
+ *---------------------------------------------------------------------------*/
+    if (_fp) fclose(_fp);
+}
+
+
+bool drvScopeReplay::_next() {
+/*-----------------------------------------------------------------------------
+ * Makes the next record current, unless the current one is not consumed
+ * yet.  Returns false at the end of the file, unless looping.
+ *---------------------------------------------------------------------------*/
+    if (_have) return true;
+    if (!_fp) return false;
+
+    for (int pass=0; pass<2; pass++) {
+        if (fread(&_rec, sizeof(_rec), 1, _fp) == 1) {
+            _data.resize(_rec.len);
+            if (!_rec.len || (fread(&_data[0], 1, _rec.len, _fp) == _rec.len)) {
+                _rpos = 0;
+                _have = true;
+                return true;
+            }
+        }
+        if (!_loop || !_records) break;
+        _rewind();
+    }
+    return false;
+}
+
+
+void drvScopeReplay::_consume() {
+/*-----------------------------------------------------------------------------
+ * Done with the current record.  The first one sets the time origin.
+ *---------------------------------------------------------------------------*/
+    if (!_started) {
+        _c0 = _rec.t;
+        epicsTimeGetCurrent(&_t0);
+        _started = true;
+    }
+    _have = false;
+    _records++;
+}
+
+
+void drvScopeReplay::_rewind() {
+/*-----------------------------------------------------------------------------
+ * Starts over at the first record, with a new time origin.
+ *---------------------------------------------------------------------------*/
+    fseek(_fp, CAP_MAGIC_LEN, SEEK_SET);
+    _have = false;
+    _started = false;
+    _passes++;
+}
+
+
+void drvScopeReplay::_schedule() {
+/*-----------------------------------------------------------------------------
+ * Waits until the current record is due.  Time the driver spent since the
+ * time origin counts, so that a slower driver is not delayed further.
+ *---------------------------------------------------------------------------*/
+    epicsTimeStamp now;
+    double wait;
+
+    if ((_speed <= 0.0) || !_started) return;
+
+    epicsTimeGetCurrent(&now);
+    wait = (_rec.t - _c0)/_speed - epicsTimeDiffInSeconds(&now, &_t0);
+    if (wait > 0.0) epicsThreadSleep(wait);
+}
+
+
+bool drvScopeReplay::_seekWrite(const char* val, size_t nc) {
+/*-----------------------------------------------------------------------------
+ * Looks for a recorded write of val in the next REPLAY_SEARCH records.
+ * When found it becomes the current record and the records before it are
+ * passed over, else the position is left as it was.
+ *---------------------------------------------------------------------------*/
+    capRec_t rec;
+    std::string data;
+    long pos;
+
+    if (!_fp || ((pos = ftell(_fp)) < 0)) return false;
+
+    for (int i=0; i<REPLAY_SEARCH; i++) {
+        if (fread(&rec, sizeof(rec), 1, _fp) != 1) break;
+        data.resize(rec.len);
+        if (rec.len && (fread(&data[0], 1, rec.len, _fp) != rec.len)) break;
+        if ((rec.type == enCapWrite) && (rec.len == nc) && !memcmp(data.data(), val, nc)) {
+            if (_have) _consume();
+            _skipped += i + 1;
+            _rec = rec;
+            _data.swap(data);
+            _rpos = 0;
+            _have = true;
+            return true;
+        }
+    }
+    fseek(_fp, pos, SEEK_SET);
+    return false;
+}
+
+
+asynStatus drvScopeReplay::writeOctet(asynUser* pau, const char* val, size_t nc, size_t* nActual) {
+/*-----------------------------------------------------------------------------
+ * This method overrides the virtual method in asynPortDriver.  Passes over
+ * the records up to the recorded write of the same bytes and returns its
+ * status.  The driver may not poll in the same order as when it was
+ * captured, e.g. when a setting is changed, so the write is looked for in
+ * the following records too.  A write that is not found is counted and
+ * dropped.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "writeOctet";
+    asynStatus status;
+
+    *nActual = 0;
+    asynPrint(pau, ASYN_TRACEIO_DRIVER, "%s::%s: %.*s\n",
+            driverName.c_str(), functionName.c_str(), (int)nc, val);
+
+    // Replies the driver did not read
+    while (_next() && (_rec.type != enCapWrite)) _consume();
+    if (!_have) {
+        epicsSnprintf(pau->errorMessage, pau->errorMessageSize,
+                "%s: end of capture", driverName.c_str());
+        return asynError;
+    }
+
+    if (((_data.size() != nc) || memcmp(_data.data(), val, nc)) && !_seekWrite(val, nc)) {
+        _mismatches++;
+        if (_mismatches <= REPLAY_MISMATCH_PRINT) {
+            asynPrint(pau, ASYN_TRACE_ERROR, "%s::%s: record %u, %.*s not in the capture\n",
+                    driverName.c_str(), functionName.c_str(), _records, (int)nc, val);
+        }
+        *nActual = nc;
+        return asynSuccess;
+    }
+
+    status = (asynStatus)_rec.status;
+    if (status == asynSuccess) *nActual = nc;
+    _consume();
+    return status;
+}
+
+
+asynStatus drvScopeReplay::readOctet(asynUser* pau, char* val, size_t nc, size_t* nActual, int* eomReason) {
+/*-----------------------------------------------------------------------------
+ * This method overrides the virtual method in asynPortDriver.  Returns up to
+ * nc bytes of the next recorded reply when it is due, with the recorded
+ * status.  A reply longer than nc is returned over several reads.  When the
+ * capture has a write next, the driver has gone out of step: the read times
+ * out at once.
+ *---------------------------------------------------------------------------*/
+    asynStatus status;
+    size_t n;
+
+    *nActual = 0;
+    if (eomReason) *eomReason = 0;
+
+    while (_next() && (_rec.type == enCapFlush)) _consume();
+    if (!_have || (_rec.type != enCapRead)) {
+        _mismatches++;
+        epicsSnprintf(pau->errorMessage, pau->errorMessageSize,
+                "%s: no reply in the capture", driverName.c_str());
+        return asynTimeout;
+    }
+
+    if (!_rpos) _schedule();
+
+    n = _data.size() - _rpos;
+    if (n > nc) n = nc;
+    memcpy(val, _data.data() + _rpos, n);
+    _rpos += n;
+    if (n < nc) val[n] = 0;
+    *nActual = n;
+
+    status = (asynStatus)_rec.status;
+    if (_rpos < _data.size()) {
+        if (eomReason) *eomReason = ASYN_EOM_CNT;
+    } else {
+        if (eomReason) *eomReason = _rec.eom;
+        _consume();
+    }
+    return status;
+}
+
+
+asynStatus drvScopeReplay::flushOctet(asynUser* pau) {
+/*-----------------------------------------------------------------------------
+ * This method overrides the virtual method in asynPortDriver.  Discards the
+ * rest of a partly read reply and passes over a recorded flush.
+ *---------------------------------------------------------------------------*/
+    if (_have && (_rec.type == enCapRead) && _rpos) _consume();
+    if (_next() && (_rec.type == enCapFlush)) _consume();
+    return asynSuccess;
+}
+
+
+void drvScopeReplay::report(FILE* fp, int details) {
+/*-----------------------------------------------------------------------------
+ * This method overrides the virtual method in asynPortDriver.
+ *---------------------------------------------------------------------------*/
+    asynPortDriver::report(fp, details);
+    fprintf(fp, "%s: %s, speed %g, %u record(s), %u skipped, %u mismatch(es), %u pass(es)\n",
+            driverName.c_str(), _fp ? _file.c_str() : "no file", _speed, _records,
+            _skipped, _mismatches, _passes);
+}
+
+
+// Configuration routines.  Called directly, or from the iocsh function below
+extern "C" {
+
+int drvScopeReplayConfigure(const char* port, const char* file, double speed, int loop) {
+/*-----------------------------------------------------------------------------
+ * EPICS iocsh callable function to call constructor for the drvScopeReplay
+ * class.
+ *  port   The name of the asyn port to be created.
+ *  file   The capture file, see drvScopeCapture.
+ *  speed  Time scale, 1 for the recorded timing, 0 for no delays.
+ *  loop   Non-zero to start over at the end of the file.
+ *---------------------------------------------------------------------------*/
+    new drvScopeReplay(port, file, speed, loop);
+    return asynSuccess;
+}
+
+/* EPICS iocsh shell commands */
+static const iocshArg initArg0 = {"port", iocshArgString};
+static const iocshArg initArg1 = {"file", iocshArgString};
+static const iocshArg initArg2 = {"speed", iocshArgDouble};
+static const iocshArg initArg3 = {"loop", iocshArgInt};
+static const iocshArg * const initArgs[] = {&initArg0, &initArg1, &initArg2, &initArg3};
+static const iocshFuncDef initFuncDef = {"drvScopeReplayConfigure", 4, initArgs};
+static void initCallFunc(const iocshArgBuf *args){
+    drvScopeReplayConfigure(args[0].sval, args[1].sval, args[2].dval, args[3].ival);
+}
+
+void drvScopeReplayRegister(void) {
+    iocshRegister(&initFuncDef, initCallFunc);
+}
+
+epicsExportRegistrar(drvScopeReplayRegister);
+}
@@ -0,0 +1,70 @@
+#ifndef DRVSCOPEREPLAY_H
+#define DRVSCOPEREPLAY_H
+
+/* drvScopeReplay.h
+ * Replay transport.  Creates an asyn octet port that answers a scope driver
+ * with the replies recorded by drvScopeCapture, so that the decoders can be
+ * profiled and compared on captured traffic without an instrument.
+ * asynPortDriver --> drvScopeReplay
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string>
+
+#include <epicsTime.h>
+#include <epicsTypes.h>
+
+#include "asynPortDriver.h"
+
+// Capture file: CAP_MAGIC, then one record per I/O operation, a capRec_t
+// followed by len bytes of data.  Numbers are in host byte order.
+#define CAP_MAGIC       "SCOPECAP1\n"
+#define CAP_MAGIC_LEN   10
+
+typedef enum {enCapWrite='W', enCapRead='R', enCapFlush='F'} capType_e;
+
+typedef struct {
+    epicsFloat64  t;            // seconds since the capture started
+    epicsUInt32   len;          // bytes of data that follow
+    epicsInt8     type;         // capType_e
+    epicsInt8     status;       // asynStatus of the operation
+    epicsInt8     eom;          // eomReason of a read
+    epicsInt8     spare;
+} capRec_t;
+
+
+class drvScopeReplay: public asynPortDriver {
+public:
+    drvScopeReplay(const char* port, const char* file, double speed, int loop);
+    virtual ~drvScopeReplay();
+
+    virtual asynStatus writeOctet(asynUser* pau, const char* val, size_t nc, size_t* nActual);
+    virtual asynStatus readOctet(asynUser* pau, char* val, size_t nc, size_t* nActual, int* eomReason);
+    virtual asynStatus flushOctet(asynUser* pau);
+    virtual void report(FILE* fp, int details);
+
+private:
+    bool          _next();
+    void          _consume();
+    bool          _seekWrite(const char* val, size_t nc);
+    void          _rewind();
+    void          _schedule();
+
+    FILE*         _fp;
+    std::string   _file;
+    double        _speed;           // 1 original timing, 2 twice as fast, 0 no delays
+    bool          _loop;            // start over at the end of the file
+    capRec_t      _rec;             // current record
+    std::string   _data;            // and its data
+    size_t        _rpos;            // bytes of _data already read
+    bool          _have;            // _rec is valid and not consumed
+    double        _c0;              // capture time of the first record replayed
+    epicsTimeStamp _t0;             // when it was replayed
+    bool          _started;
+    unsigned      _records;         // records replayed
+    unsigned      _mismatches;      // writes and reads not in the capture
+    unsigned      _skipped;         // records passed over to find a write
+    unsigned      _passes;          // times the file was started over
+};
+
+#endif    // DRVSCOPEREPLAY_H
@@ -0,0 +1,676 @@
+/* drvScopeSim.cpp
+ * Loopback SCPI scope simulator.  An asyn octet port which answers the
+ * commands sent by drvTDS, drvMDO, drvDS1x and drvDS6x with plausible
+ * replies: setting commands are remembered and returned by the matching
+ * query, waveform queries return a realistic preamble and an IEEE-488.2
+ * "#N<len>" binary block holding a sine wave on every channel.
+ * asynPortDriver --> drvScopeSim
+ *
+ * Usage in st.cmd, before the scope driver is configured:
+ *   drvScopeSimConfigure("SIM", "TDS", 0, 0.002)
+ *   drvTDSConfigure("SCOPE", "SIM")
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <math.h>
+
+#include <epicsTime.h>
+#include <epicsThread.h>
+#include <epicsStdio.h>
+#include <epicsExport.h>
+#include <iocsh.h>
+
+#include "drvScopeSim.h"
+
+#define SIM_TRIG_RATE   10.0    // simulated triggers per second while running
+#define SIM_CNT_DIV     25      // ADC counts per vertical division (8 bit)
+
+namespace {
+const std::string driverName = "drvScopeSim";
+
+const char* modelNames[] = {"TDS", "MDO", "DS1", "DS6"};
+
+const char* idnStr[] = {
+    "TEKTRONIX,TDS 3034B,0,CF:91.1CT FV:v3.41 TDS3FFT:v1.00 (simulated)",
+    "TEKTRONIX,MDO34,C000000,CF:91.1CT FV:v1.30 (simulated)",
+    "RIGOL TECHNOLOGIES,DS1104Z,DS1ZA000000000,00.04.04 (simulated)",
+    "RIGOL TECHNOLOGIES,DS6104,DS6A000000000,00.01.05 (simulated)"};
+
+// Power-on state.  Headers are in the form used by the drivers, values are
+// what the instrument returns to the corresponding query.
+const char* tekDefaults[][2] = {
+    {"SEL:CH1", "1"},           {"SEL:CH2", "1"},
+    {"SEL:CH3", "1"},           {"SEL:CH4", "1"},
+    {"CH1:POS", "0.0E0"},       {"CH2:POS", "0.0E0"},
+    {"CH3:POS", "0.0E0"},       {"CH4:POS", "0.0E0"},
+    {"CH1:SCA", "1.0E0"},       {"CH2:SCA", "1.0E0"},
+    {"CH3:SCA", "1.0E0"},       {"CH4:SCA", "1.0E0"},
+    {"CH1:IMP", "MEG"},         {"CH2:IMP", "MEG"},
+    {"CH3:IMP", "MEG"},         {"CH4:IMP", "MEG"},
+    {"CH1:COUP", "DC"},         {"CH2:COUP", "DC"},
+    {"CH3:COUP", "DC"},         {"CH4:COUP", "DC"},
+    {"DAT:SOU", "CH1"},         {"DAT:ENC", "RIBINARY"},
+    {"DAT:WID", "1"},           {"DAT:STAR", "1"},
+    {"DAT:STOP", "500"},        {"HOR:RECORDL", "500"},
+    {"HOR:MAI:SCA", "4.0E-4"},  {"HOR:SCA", "4.0E-4"},
+    {"HOR:DEL:TIM", "0.0E0"},   {"HOR:DEL:STATE", "1"},
+    {"HOR:DEL:MOD", "1"},       {"HOR:TRIG:POS", "5.0E1"},
+    {"HOR:POS", "5.0E1"},       {"TRIG:A:LEV", "0.0E0"},
+    {"TRIG:A:HOL", "2.5E-7"},   {"TRIG:A:MOD", "AUTO"},
+    {"TRIG:A:EDGE:SOU", "CH1"}, {"TRIG:A:EDGE:SLO", "RISE"},
+    {"ACQ:STATE", "1"},         {"HEAD", "0"},
+    {"VERB", "1"},              {"ETHER:IPADD", "\"127.0.0.1\""},
+    {"MEASU:MEAS1:TYP", "AMPLITUDE"}, {"MEASU:MEAS2:TYP", "FREQUENCY"},
+    {"MEASU:MEAS3:TYP", "MEAN"},      {"MEASU:MEAS4:TYP", "RMS"},
+    {"MEASU:MEAS1:STATE", "0"}, {"MEASU:MEAS2:STATE", "0"},
+    {"MEASU:MEAS3:STATE", "0"}, {"MEASU:MEAS4:STATE", "0"},
+    {"MEASU:MEAS1:UNI", "\"V\""},     {"MEASU:MEAS2:UNI", "\"Hz\""},
+    {"MEASU:MEAS3:UNI", "\"V\""},     {"MEASU:MEAS4:UNI", "\"V\""},
+    {"MEASU:MEAS1:VAL", "5.0E0"},     {"MEASU:MEAS2:VAL", "1.0E3"},
+    {"MEASU:MEAS3:VAL", "0.0E0"},     {"MEASU:MEAS4:VAL", "1.77E0"}};
+
+const char* rigolDefaults[][2] = {
+    {":CHAN1:DISP", "1"},       {":CHAN2:DISP", "1"},
+    {":CHAN3:DISP", "1"},       {":CHAN4:DISP", "1"},
+    {":CHAN1:OFFS", "0.000000e+00"}, {":CHAN2:OFFS", "0.000000e+00"},
+    {":CHAN3:OFFS", "0.000000e+00"}, {":CHAN4:OFFS", "0.000000e+00"},
+    {":CHAN1:SCAL", "1.000000e+00"}, {":CHAN2:SCAL", "1.000000e+00"},
+    {":CHAN3:SCAL", "1.000000e+00"}, {":CHAN4:SCAL", "1.000000e+00"},
+    {":CHAN1:COUP", "DC"},      {":CHAN2:COUP", "DC"},
+    {":CHAN3:COUP", "DC"},      {":CHAN4:COUP", "DC"},
+    {":CHAN1:IMP", "OMEG"},     {":CHAN2:IMP", "OMEG"},
+    {":CHAN3:IMP", "OMEG"},     {":CHAN4:IMP", "OMEG"},
+    {":WAV:SOUR", "CHAN1"},     {":WAV:FORM", "BYTE"},
+    {":WAV:POIN", "600"},       {":WAV:STAR", "0"},
+    {":WAV:STOP", "599"},       {":TIM:SCAL", "1.000000e-03"},
+    {":TIM:OFFS", "0.000000e+00"},   {":TIM:MODE", "MAIN"},
+    {":TIM:DEL:OFFS", "0.000000e+00"}, {":TIM:DEL:SCAL", "5.000000e-07"},
+    {":TIM:DEL:ENAB", "0"},     {":TIM:HREF:POS", "0"},
+    {":TIM:HREF:MODE", "CENT"}, {":TRIG:MODE", "EDGE"},
+    {":TRIG:EDGE:SOUR", "CHAN1"},    {":TRIG:EDGE:LEV", "0.000000e+00"},
+    {":TRIG:EDGE:SLOP", "POS"}, {":TRIG:EDGE:SWE", "AUTO"},
+    {":TRIG:SWE", "AUTO"},      {":TRIG:COUP", "DC"},
+    {":TRIG:HOLD", "1.000000e-07"},  {":TRIG:STAT", "TD"},
+    {":ACQ:TYPE", "NORM"},      {":ACQ:MODE", "RTIM"},
+    {":ACQ:AVER", "2"},         {":ACQ:SRAT", "1.000000e+09"},
+    {":LAN:IPAD", "127.0.0.1"}};
+}
+
+
+drvScopeSim::drvScopeSim(const char* port, const char* model, int recordLength, double latency):
+        asynPortDriver(port, 1,
+                asynOctetMask | asynDrvUserMask,
+                asynOctetMask,
+                ASYN_CANBLOCK, 1, 0, 0),
+                _model(enSimTDS),
+                _recordLength(recordLength),
+                _latency(latency),
+                _numAcq(0),
+                _ese(0),
+                _phase(0.0),
+                _rpos(0),
+                _delay(false) {
+/*------------------------------------------------------------------------------
+ * Constructor for the drvScopeSim class. Calls constructor for the
+ * asynPortDriver base class.
+ *  port          The name of the asyn port to be created.
+ *  model         One of TDS, MDO, DS1 or DS6.
+ *  recordLength  Number of points per trace, 0 to follow the scope settings.
+ *  latency       Time (s) the "instrument" takes before a reply can be read.
+ *---------------------------------------------------------------------------*/
+    for (size_t i=0; i<sizeof(modelNames)/sizeof(modelNames[0]); i++) {
+        if (model && !strncmp(model, modelNames[i], strlen(modelNames[i]))) {
+            _model = i;
+        }
+    }
+    if (_latency < 0.0) _latency = 0.0;
+
+    _initState();
+
+    epicsPrintf("%s::%s: port %s simulating %s, recordLength=%d, latency=%g s\n",
+            driverName.c_str(), driverName.c_str(), port, modelNames[_model],
+            _recordLength, _latency);
+}
+
+
+std::string drvScopeSim::_key(const std::string& hdr) {
+/*-----------------------------------------------------------------------------
+ * Reduces a command header to a key, so that the short and the long form of
+ * a header, with or without a leading colon or trailing '?', map to the same
+ * state entry.  Every node keeps at most three letters plus its numeric
+ * suffix, e.g. ":TRIGger:EDGE:SOURce?" -> "TRI:EDG:SOU", "CHAN1" -> "CHA1".
+ * Common commands ("*ESE", "*ESR") are kept whole.
+ *---------------------------------------------------------------------------*/
+    std::string key, node;
+    size_t i = 0;
+
+    while ((i < hdr.size()) && (hdr[i] == ':')) i++;
+
+    for (; i <= hdr.size(); i++) {
+        char c = (i < hdr.size()) ? toupper(hdr[i]) : ':';
+        if (c == '?') continue;
+        if (c != ':') {
+            node += c;
+            continue;
+        }
+        size_t n = 0;
+        while ((n < node.size()) && !isdigit(node[n])) n++;
+        if ((n > 3) && (node[0] != '*')) node.erase(3, n - 3);
+        if (!key.empty()) key += ':';
+        key += node;
+        node.clear();
+    }
+
+    return key;
+}
+
+
+void drvScopeSim::_initState() {
+/*-----------------------------------------------------------------------------
+ * Loads the power-on state of the simulated model.
+ *---------------------------------------------------------------------------*/
+    _state.clear();
+    _names.clear();
+
+    if ((_model == enSimTDS) || (_model == enSimMDO)) {
+        for (size_t i=0; i<sizeof(tekDefaults)/sizeof(tekDefaults[0]); i++) {
+            _set(tekDefaults[i][0], tekDefaults[i][1]);
+        }
+    } else {
+        for (size_t i=0; i<sizeof(rigolDefaults)/sizeof(rigolDefaults[0]); i++) {
+            _set(rigolDefaults[i][0], rigolDefaults[i][1]);
+        }
+    }
+
+    epicsTimeGetCurrent(&_tAcq);
+}
+
+
+std::string drvScopeSim::_get(const std::string& hdr) {
+/*-----------------------------------------------------------------------------
+ * Returns the value of a setting, or "0" if it was never set.
+ *---------------------------------------------------------------------------*/
+    std::map<std::string, std::string>::iterator it = _state.find(_key(hdr));
+    if (it == _state.end()) return "0";
+    return it->second;
+}
+
+
+void drvScopeSim::_set(const std::string& hdr, const std::string& val) {
+/*-----------------------------------------------------------------------------
+ * Stores the value of a setting.  The header is remembered in the form it was
+ * first seen, for the learn string.
+ *---------------------------------------------------------------------------*/
+    std::string key = _key(hdr);
+
+    if (_names.find(key) == _names.end()) {
+        _names[key] = (hdr[0] == ':') ? hdr.substr(1) : hdr;
+    }
+    _state[key] = val;
+}
+
+
+bool drvScopeSim::_isTek() {
+/*---------------------------------------------------------------------------*/
+    return (_model == enSimTDS) || (_model == enSimMDO);
+}
+
+
+bool drvScopeSim::_running() {
+/*-----------------------------------------------------------------------------
+ * Returns true while the simulated acquisition is running.
+ *---------------------------------------------------------------------------*/
+    if (_isTek()) return atoi(_get("ACQ:STATE").c_str()) != 0;
+    return _get(":TRIG:STAT") != "STOP";
+}
+
+
+void drvScopeSim::_acquire() {
+/*-----------------------------------------------------------------------------
+ * Advances the acquisition counter by the number of triggers that occurred
+ * since the last call, at SIM_TRIG_RATE while the acquisition is running.
+ *---------------------------------------------------------------------------*/
+    epicsTimeStamp now;
+    int ntrig;
+
+    epicsTimeGetCurrent(&now);
+    if (!_running()) {
+        _tAcq = now;
+        return;
+    }
+
+    ntrig = (int)(epicsTimeDiffInSeconds(&now, &_tAcq)*SIM_TRIG_RATE);
+    if (ntrig <= 0) return;
+
+    _numAcq += ntrig;
+    _phase += 0.1*ntrig;
+    epicsTimeAddSeconds(&_tAcq, ntrig/SIM_TRIG_RATE);
+}
+
+
+int drvScopeSim::_source() {
+/*-----------------------------------------------------------------------------
+ * Returns the channel (1..4) selected as the waveform data source.
+ *---------------------------------------------------------------------------*/
+    std::string src = _isTek() ? _get("DAT:SOU") : _get(":WAV:SOUR");
+    int ch = src.empty() ? 1 : src[src.size()-1] - '0';
+
+    if ((ch < 1) || (ch > 4)) ch = 1;
+    return ch;
+}
+
+
+std::vector<int> drvScopeSim::_sources() {
+/*-----------------------------------------------------------------------------
+ * Returns the channels (1..4) in a Tek source list, e.g. "CH1,CH3".
+ *---------------------------------------------------------------------------*/
+    std::string src = _get("DAT:SOU");
+    std::vector<int> chs;
+
+    for (size_t i=0; i<src.size(); i++) {
+        if (isdigit(src[i]) && ((i + 1 == src.size()) || (src[i+1] == ','))) {
+            int ch = src[i] - '0';
+            if ((ch >= 1) && (ch <= 4)) chs.push_back(ch);
+        }
+    }
+    if (chs.empty()) chs.push_back(1);
+    return chs;
+}
+
+
+int drvScopeSim::_numPoints() {
+/*-----------------------------------------------------------------------------
+ * Returns the number of points in a waveform transfer.
+ *---------------------------------------------------------------------------*/
+    int n;
+
+    if (_recordLength > 0) return _recordLength;
+
+    if (_isTek()) {
+        int rl = atoi(_get("HOR:RECORDL").c_str());
+        int start = atoi(_get("DAT:STAR").c_str());
+        int stop = atoi(_get("DAT:STOP").c_str());
+        if (start < 1) start = 1;
+        if ((stop > rl) || (stop < start)) stop = rl;
+        n = stop - start + 1;
+    } else {
+        n = atoi(_get(":WAV:POIN").c_str());
+    }
+
+    return (n < 1) ? 1 : n;
+}
+
+
+int drvScopeSim::_dataWidth() {
+/*-----------------------------------------------------------------------------
+ * Returns the number of bytes per waveform point.
+ *---------------------------------------------------------------------------*/
+    if (_isTek()) return (atoi(_get("DAT:WID").c_str()) == 2) ? 2 : 1;
+    return (_get(":WAV:FORM").compare(0, 1, "W") == 0) ? 2 : 1;
+}
+
+
+double drvScopeSim::_chanScale(int ch) {
+/*-----------------------------------------------------------------------------
+ * Returns vertical scale of channel ch (1..4) in V/div.
+ *---------------------------------------------------------------------------*/
+    char hdr[32];
+    double v;
+
+    sprintf(hdr, _isTek() ? "CH%d:SCA" : ":CHAN%d:SCAL", ch);
+    v = atof(_get(hdr).c_str());
+    return (v > 0.0) ? v : 1.0;
+}
+
+
+std::string drvScopeSim::_tekPreamble(int ch) {
+/*-----------------------------------------------------------------------------
+ * Returns the WFMPRE part of a WAVF? reply, including the trailing ';'.
+ * Data encoding follows DAT:ENC, i.e. RIB, RPB, SRI or SRP.
+ *---------------------------------------------------------------------------*/
+    char str[512];
+    std::string enc = _get("DAT:ENC");
+    bool lsb = (enc[0] == 'S');
+    bool sgn = (enc.find("RP") == std::string::npos);
+    int nbyt = _dataWidth();
+    int n = _numPoints();
+    double hs = atof(_get((_model == enSimTDS) ? "HOR:MAI:SCA" : "HOR:SCA").c_str());
+    double vdiv = _chanScale(ch);
+    double ymult = vdiv/SIM_CNT_DIV/((nbyt == 2) ? 256.0 : 1.0);
+    double yof = sgn ? 0.0 : ((nbyt == 2) ? 32768.0 : 128.0);
+    double xinc = hs*10.0/n;
+
+    if (_model == enSimTDS) {
+        sprintf(str, "%d;%d;BIN;%s;%s;%d;\"Ch%d, DC coupling, %.1E V/div, %.1E s/div, %d points\";"
+                "Y;%.6E;0;%.6E;\"s\";%.6E;0.0E0;%.6E;\"V\";",
+                nbyt, nbyt*8, sgn ? "RI" : "RP", lsb ? "LSB" : "MSB", n, ch, vdiv, hs, n,
+                xinc, -5.0*hs, ymult, yof);
+    } else {
+        sprintf(str, "%d;%d;BINARY;%s;%s;\"Ch%d, DC coupling, %.1E V/div, %.1E s/div, %d points\";"
+                "%d;Y;LINEAR;\"s\";%.6E;%.6E;0;\"V\";%.6E;%.6E;0.0E0;TIME;ANALOG;0.0E0;0.0E0;0.0E0;",
+                nbyt, nbyt*8, sgn ? "RI" : "RP", lsb ? "LSB" : "MSB", ch, vdiv, hs, n,
+                n, xinc, -5.0*hs, ymult, yof);
+    }
+
+    return str;
+}
+
+
+std::string drvScopeSim::_rigolPreamble(int ch) {
+/*-----------------------------------------------------------------------------
+ * Returns the :WAV:PRE? reply:
+ * format,type,points,count,xincrement,xorigin,xreference,yincrement,yorigin,
+ * yreference.
+ *---------------------------------------------------------------------------*/
+    char str[256];
+    int n = _numPoints();
+    double hs = atof(_get(":TIM:SCAL").c_str());
+
+    sprintf(str, "%d,0,%d,1,%e,%e,0,%e,%e,%d",
+            (_dataWidth() == 2) ? 1 : 0, n, hs*10.0/n, -5.0*hs,
+            _chanScale(ch)/SIM_CNT_DIV, 0.0, 127);
+
+    return str;
+}
+
+
+std::string drvScopeSim::_block(int ch) {
+/*-----------------------------------------------------------------------------
+ * Returns an IEEE-488.2 definite length block with the waveform of channel
+ * ch (1..4), a sine wave of +/-2.5 divisions with a few counts of noise.
+ *---------------------------------------------------------------------------*/
+    char hdr[32];
+    int n = _numPoints();
+    int w = _dataWidth();
+    bool lsb = true, sgn = false;
+    std::string blk;
+
+    _acquire();
+
+    if (_isTek()) {
+        std::string enc = _get("DAT:ENC");
+        lsb = (enc[0] == 'S');
+        sgn = (enc.find("RP") == std::string::npos);
+        sprintf(hdr, "%d", n*w);
+        sprintf(hdr, "#%d%d", (int)strlen(hdr), n*w);
+    } else {
+        sprintf(hdr, "#9%09d", n*w);
+    }
+
+    blk.reserve(strlen(hdr) + n*w);
+    blk = hdr;
+
+    for (int i=0; i<n; i++) {
+        double y = 2.5*SIM_CNT_DIV*sin(2.0*M_PI*3.0*i/n + _phase + ch) + (rand()%5 - 2);
+        int v;
+
+        if (_isTek()) {
+            v = (w == 2) ? (int)(y*256.0) + (rand()%256 - 128) : (int)y;
+            if (!sgn) v += (w == 2) ? 32768 : 128;
+        } else {
+            v = 127 + (int)y;
+            v = (v < 0) ? 0 : ((v > 255) ? 255 : v);
+            lsb = true;
+        }
+
+        if (w == 1) {
+            blk += (char)(v & 0xff);
+        } else if (lsb) {
+            blk += (char)(v & 0xff);
+            blk += (char)((v >> 8) & 0xff);
+        } else {
+            blk += (char)((v >> 8) & 0xff);
+            blk += (char)(v & 0xff);
+        }
+    }
+
+    return blk;
+}
+
+
+std::string drvScopeSim::_snapshot() {
+/*-----------------------------------------------------------------------------
+ * Returns the learn string (*LRN?, SET?): every setting with its header.  As
+ * on the instrument, a header that shares its path with the previous one is
+ * sent relative to it, e.g. ":CH1:POS 0.0E0;SCA 1.0E0".
+ *---------------------------------------------------------------------------*/
+    std::string str = ":HEADER 1;:VERBOSE 1";
+    std::string path, prev;
+    std::map<std::string, std::string>::iterator it;
+    size_t n;
+
+    for (it = _names.begin(); it != _names.end(); ++it) {
+        n = it->second.rfind(':');
+        path = (n == std::string::npos) ? "" : it->second.substr(0, n);
+        if (!path.empty() && (path == prev)) {
+            str += ";" + it->second.substr(n + 1);
+        } else {
+            str += ";:" + it->second;
+        }
+        str += " " + _state[it->first];
+        prev = path;
+    }
+
+    return str;
+}
+
+
+void drvScopeSim::_query(const std::string& hdr) {
+/*-----------------------------------------------------------------------------
+ * Appends the reply to query hdr to the pending reply.
+ *---------------------------------------------------------------------------*/
+    std::string key = _key(hdr);
+    std::string val;
+    char str[32];
+
+    if (key == "*IDN") {
+        val = idnStr[_model];
+    } else if (key == "*OPC") {
+        val = "1";
+    } else if (key == "*ESE") {
+        sprintf(str, "%d", _ese);
+        val = str;
+    } else if ((key == "*ESR") || (key == "*STB") || (key == "EVQ")) {
+        val = "0";
+    } else if ((key == "*LRN") || (key == "SET")) {
+        val = _snapshot();
+    } else if (key == "EVM") {
+        val = "0,\"No events to report - queue empty\"";
+    } else if (key == "SYS:ERR") {
+        val = "0,\"No error\"";
+    } else if (_isTek() && (key == "WAV")) {
+        val = _tekPreamble(_source()) + _block(_source());
+    } else if (_isTek() && (key == "CUR")) {
+        std::vector<int> chs = _sources();
+        for (size_t i=0; i<chs.size(); i++) {
+            if (i) val += ',';
+            val += _block(chs[i]);
+        }
+    } else if (_isTek() && (key == "WFM")) {
+        std::vector<int> chs = _sources();
+        for (size_t i=0; i<chs.size(); i++) {
+            val += _tekPreamble(chs[i]);
+        }
+        val.erase(val.size()-1);
+    } else if (!_isTek() && (key == "WAV:PRE")) {
+        val = _rigolPreamble(_source());
+    } else if (!_isTek() && (key == "WAV:DAT")) {
+        val = _block(_source());
+    } else if (_isTek() && (key == "TRI:STA")) {
+        val = _running() ? "TRIGGER" : "SAVE";
+    } else if (key == "ACQ:NUM") {
+        _acquire();
+        sprintf(str, "%u", _numAcq);
+        val = str;
+    } else {
+        val = _get(hdr);
+    }
+
+    if (!_reply.empty()) _reply += ';';
+    _reply += val;
+}
+
+
+void drvScopeSim::_execute(const std::string& cmnd) {
+/*-----------------------------------------------------------------------------
+ * Executes one command of a (possibly compound) program message.
+ *---------------------------------------------------------------------------*/
+    size_t b = cmnd.find_first_not_of(" \t\r\n");
+    if (b == std::string::npos) return;
+
+    size_t e = cmnd.find_first_of(" \t\r\n", b);
+    std::string hdr = cmnd.substr(b, (e == std::string::npos) ? e : e - b);
+    std::string arg;
+
+    if (e != std::string::npos) {
+        size_t a = cmnd.find_first_not_of(" \t\r\n", e);
+        size_t z = cmnd.find_last_not_of(" \t\r\n");
+        if (a != std::string::npos) arg = cmnd.substr(a, z - a + 1);
+    }
+
+    if (hdr.find('?') != std::string::npos) {
+        _query(hdr);
+        return;
+    }
+
+    std::string key = _key(hdr);
+    if (key == "*RST") {
+        _initState();
+    } else if (key == "*ESE") {
+        _ese = atoi(arg.c_str()) & 0xff;
+    } else if (!_isTek() && (key == "RUN")) {
+        _set(":TRIG:STAT", "TD");
+    } else if (!_isTek() && (key == "STO")) {
+        _set(":TRIG:STAT", "STOP");
+    } else if (_isTek() && (key == "ACQ:STA")) {
+        bool run = (arg == "RUN") || (arg == "ON") || (atoi(arg.c_str()) != 0);
+        _set(hdr, run ? "1" : "0");
+    } else if (!arg.empty() && (key[0] != '*')) {
+        _set(hdr, arg);
+    }
+}
+
+
+asynStatus drvScopeSim::writeOctet(asynUser* pau, const char* val, size_t nc, size_t* nActual) {
+/*-----------------------------------------------------------------------------
+ * This method overrides the virtual method in asynPortDriver.  The program
+ * message is split into commands, which are executed in order.  Replies to
+ * all queries are joined with ';' and terminated with a new line.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "writeOctet";
+    std::string msg(val, nc);
+    std::string cmnd, unread;
+    bool quoted = false;
+
+    asynPrint(pau, ASYN_TRACEIO_DRIVER, "%s::%s: %.*s\n",
+            driverName.c_str(), functionName.c_str(), (int)nc, val);
+
+    // Like the scope's output queue, a reply that was not read stays in front
+    // of the next one
+    unread = _reply.substr(_rpos);
+    _reply.clear();
+    _rpos = 0;
+
+    for (size_t i=0; i<=msg.size(); i++) {
+        char c = (i < msg.size()) ? msg[i] : ';';
+        if (c == '"') quoted = !quoted;
+        if (!quoted && ((c == ';') || (c == '\n'))) {
+            _execute(cmnd);
+            cmnd.clear();
+        } else {
+            cmnd += c;
+        }
+    }
+
+    if (!_reply.empty()) {
+        _reply += '\n';
+        _delay = true;
+    }
+    _reply.insert(0, unread);
+
+    *nActual = nc;
+    return asynSuccess;
+}
+
+
+asynStatus drvScopeSim::readOctet(asynUser* pau, char* val, size_t nc, size_t* nActual, int* eomReason) {
+/*-----------------------------------------------------------------------------
+ * This method overrides the virtual method in asynPortDriver.  Returns up to
+ * nc bytes of the pending reply.  Like a real instrument, a read with nothing
+ * to return waits for the timeout.
+ *---------------------------------------------------------------------------*/
+    size_t n;
+
+    *nActual = 0;
+    if (eomReason) *eomReason = 0;
+
+    if (_rpos >= _reply.size()) {
+        if (pau->timeout > 0.0) epicsThreadSleep(pau->timeout);
+        epicsSnprintf(pau->errorMessage, pau->errorMessageSize,
+                "%s: no reply pending", driverName.c_str());
+        return asynTimeout;
+    }
+
+    if (_delay) {
+        if (_latency > 0.0) epicsThreadSleep(_latency);
+        _delay = false;
+    }
+
+    n = _reply.size() - _rpos;
+    if (n > nc) n = nc;
+    memcpy(val, _reply.data() + _rpos, n);
+    _rpos += n;
+    if (n < nc) val[n] = 0;
+
+    *nActual = n;
+    if (eomReason) *eomReason = (_rpos >= _reply.size()) ? ASYN_EOM_END : ASYN_EOM_CNT;
+    return asynSuccess;
+}
+
+
+asynStatus drvScopeSim::flushOctet(asynUser* pau) {
+/*-----------------------------------------------------------------------------
+ * This method overrides the virtual method in asynPortDriver.  Discards any
+ * unread reply.
+ *---------------------------------------------------------------------------*/
+    _reply.clear();
+    _rpos = 0;
+    return asynSuccess;
+}
+
+
+// Configuration routines.  Called directly, or from the iocsh function below
+extern "C" {
+
+int drvScopeSimConfigure(const char* port, const char* model, int recordLength, double latency) {
+/*-----------------------------------------------------------------------------
+ * EPICS iocsh callable function to call constructor for the drvScopeSim class.
+ *  port          The name of the asyn port to be created.
+ *  model         One of TDS, MDO, DS1 or DS6.
+ *  recordLength  Points per trace, 0 to follow the scope settings.
+ *  latency       Reply latency in seconds.
+ *---------------------------------------------------------------------------*/
+    new drvScopeSim(port, model, recordLength, latency);
+    return asynSuccess;
+}
+
+/* EPICS iocsh shell commands */
+static const iocshArg initArg0 = {"port", iocshArgString};
+static const iocshArg initArg1 = {"model", iocshArgString};
+static const iocshArg initArg2 = {"recordLength", iocshArgInt};
+static const iocshArg initArg3 = {"latency", iocshArgDouble};
+static const iocshArg * const initArgs[] = {&initArg0, &initArg1, &initArg2, &initArg3};
+static const iocshFuncDef initFuncDef = {"drvScopeSimConfigure", 4, initArgs};
+static void initCallFunc(const iocshArgBuf *args){
+    drvScopeSimConfigure(args[0].sval, args[1].sval, args[2].ival, args[3].dval);
+}
+
+void drvScopeSimRegister(void) {
+    iocshRegister(&initFuncDef, initCallFunc);
+}
+
+epicsExportRegistrar(drvScopeSimRegister);
+}
@@ -0,0 +1,66 @@
+#ifndef DRVSCOPESIM_H
+#define DRVSCOPESIM_H
+
+/* drvScopeSim.h
+ * Loopback SCPI scope simulator.  Creates an asyn octet port that speaks the
+ * subset of the Tektronix (TDS, MDO) and Rigol (DS1x, DS6x) command sets used
+ * by the drivers in this module, so that they can be run and benchmarked
+ * without an instrument.
+ * asynPortDriver --> drvScopeSim
+ *---------------------------------------------------------------------------*/
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <epicsTime.h>
+
+#include "asynPortDriver.h"
+
+typedef enum {enSimTDS, enSimMDO, enSimDS1, enSimDS6} simModel_e;
+
+
+class drvScopeSim: public asynPortDriver {
+public:
+    drvScopeSim(const char* port, const char* model, int recordLength, double latency);
+    virtual ~drvScopeSim() {}
+
+    virtual asynStatus writeOctet(asynUser* pau, const char* val, size_t nc, size_t* nActual);
+    virtual asynStatus readOctet(asynUser* pau, char* val, size_t nc, size_t* nActual, int* eomReason);
+    virtual asynStatus flushOctet(asynUser* pau);
+
+private:
+    std::string   _key(const std::string& hdr);
+    std::string   _get(const std::string& hdr);
+    void          _set(const std::string& hdr, const std::string& val);
+    void          _initState();
+    bool          _isTek();
+    bool          _running();
+    void          _acquire();
+    int           _source();
+    std::vector<int> _sources();
+    void          _execute(const std::string& cmnd);
+    void          _query(const std::string& hdr);
+    int           _numPoints();
+    int           _dataWidth();
+    double        _chanScale(int ch);
+    std::string   _tekPreamble(int ch);
+    std::string   _rigolPreamble(int ch);
+    std::string   _block(int ch);
+    std::string   _snapshot();
+
+    int           _model;
+    int           _recordLength;    // when > 0 overrides the scope setting
+    double        _latency;         // delay before a reply is available (s)
+    unsigned      _numAcq;          // acquisition counter
+    int           _ese;             // event status enable register
+    double        _phase;
+    epicsTimeStamp _tAcq;           // time of last counted trigger
+    std::map<std::string, std::string> _state;    // key --> value
+    std::map<std::string, std::string> _names;    // key --> header as first seen
+    std::string   _reply;           // pending reply bytes
+    size_t        _rpos;            // read position in _reply
+    bool          _delay;           // apply latency before next read
+};
+
+#endif    // DRVSCOPESIM_H
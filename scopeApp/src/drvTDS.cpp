@@ -43,6 +43,9 @@ void drvTDS::_initializeParams() {
     ChCplCmnd      = "CH%d:COUP";
     ChSclCmnd      = "CH%d:SCA";
     WfDatCmnd      = "DAT:SOU CH%d; :WAVF?";
+    WfAllCmnd      = "DAT:SOU %s; :WFMP?; :CURV?";
+    WfCurvCmnd     = "DAT:SOU CH%d; :CURV?";
+    WfCurvAllCmnd  = "DAT:SOU %s; :CURV?";
     WfNptCmnd      = "HOR:RECORDL";
     WfWidCmnd      = "DAT:WID";
     WfStrtCmnd     = "DAT:STAR";
@@ -59,6 +62,7 @@ void drvTDS::_initializeParams() {
     TrigSloCmnd    = "TRIG:A:EDGE:SLO";
     AcqStateCmnd   = "ACQ:STATE";
     TrigStaCmnd    = "TRIG:STATE?";
+    AcqNumCmnd     = "ACQ:NUMACQ?";
     RunCmnd        = "ACQ:STATE RUN";
     StopCmnd       = "ACQ:STATE STOP";
     EseCmnd        = "*ESE";
@@ -73,7 +77,7 @@ void drvTDS::_initializeParams() {
     IdnCmnd        = "*IDN?";
     IPAddrCmnd     = "ETHER:IPADD?";
     WfSouCmnd      = "DATA:SOU";
-    InitCmnd       = "*CLS; :DAT:ENC RIB; :HOR:RECORDL 500; :HEAD OFF; :VERB ON; DAT:WID 1; :DAT:STAR 1; :DAT:STOP 500; HOR:DEL:STATE 1";
+    InitCmnd       = "*CLS; :DAT:ENC " TEK_NATIVE_ENC "; :HOR:RECORDL 500; :HEAD OFF; :VERB ON; DAT:WID 1; :DAT:STAR 1; :DAT:STOP 500; HOR:DEL:STATE 1";
     HeaderCmnd     = "HEAD?";
     GetConfCmnd    = "*LRN?";
     ErrMsgCmnd     = "EVM?";
@@ -152,12 +156,13 @@ void drvTDS::_initializeParams() {
 }
 
 
-int drvTDS::_parseWfPreamble(const char* buf, int* ln, int* nb, double* ym, double* yz, double* yo) {
+int drvTDS::_parseWfPreamble(const char* buf, int* ln, wfFormat_t* pf, double* ym, double* yz, double* yo) {
 /*-----------------------------------------------------------------------------
- * Unpacks the waveform preamble string.  Returns the length of the preamble.
+ * Unpacks the waveform preamble string and the data format of the block that
+ * follows it.  Returns the length of the preamble.
  *---------------------------------------------------------------------------*/
     const std::string functionName = "_parseWfPreamble";
-    int preamble_len = 0, num_params = 0, wd = 0; 
+    int preamble_len = 0, num_params = 0; 
     int nbyt, nbit, wf_len, ptof; 
     char enc[20], bfmt[20], bord[20], ids[80], ptfm[20], xunt[20], yunt[20];
     double xinc, xzr, ymult, yzr, yof;
@@ -185,23 +190,18 @@ int drvTDS::_parseWfPreamble(const char* buf, int* ln, int* nb, double* ym, doub
         }
     }
 
-    // wd is the width of chars in the waveform length, e.g. for 500, wd = 3
-    if ((num_params = sscanf(&buf[preamble_len], "#%1d", &wd)) != 1) {
-        asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: failed to get width, num_params=%d\n",
-                driverName.c_str(), functionName.c_str(), num_params);
-        return -1;
-    }
-
-    preamble_len += (2 + wd);
-
     //printf("_parseWfPreamble: nbyt=%d,nbit=%d,enc=%s,bfmt=%s\n", nbyt, nbit, enc, bfmt);
     //printf("_parseWfPreamble: bord=%s,wf_len=%d,ids=%s,ptfm=%s\n", bord, wf_len, ids, ptfm);
     //printf("_parseWfPreamble: xinc=%g,ptof=%d,xzr=%g,xunt=%s\n", xinc, ptof, xzr, xunt);
     //printf("_parseWfPreamble: ymult=%g,yzr=%g,yof=%g,yunt=%s\n", ymult, yzr, yof, yunt);
-    //printf("_parseWfPreamble: preamble_len=%d, wd=%d\n", preamble_len, wd);
+
+    if (!_wfFormat(nbyt, enc, bfmt, bord, pf)) {
+        asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s::%s: unsupported data format %s;%d;%s;%s\n",
+                driverName.c_str(), functionName.c_str(), enc, nbyt, bfmt, bord);
+        return -1;
+    }
 
     *ln = wf_len;
-    *nb = nbyt;
     *ym = ymult;
     *yz = yzr;
     *yo = yof;
@@ -15,7 +15,7 @@ public:
     virtual ~drvTDS(){}
   
 protected:
-    virtual int _parseWfPreamble(const char* buf, int*, int*, double*, double*, double*);
+    virtual int _parseWfPreamble(const char* buf, int*, wfFormat_t*, double*, double*, double*);
 
 private:
     void _initializeParams();
@@ -16,6 +16,7 @@
 #include <iocsh.h>
 
 #include "drvTek.h"
+#include "wfConvert.h"
 
 namespace {
     const std::string driverName = "drvTek";
@@ -24,6 +25,7 @@ namespace {
 
 drvTek::drvTek(const char* port, const char* udp):
         drvScope(port, udp),
+        _traceLen(0),
         _max_wf_length(1000),
         _num_meas(4),
         _trigd_enum_val(4) {
@@ -71,6 +73,8 @@ drvTek::drvTek(const char* port, const char* udp):
     createParam(meas4StateStr,    asynParamInt32,         &_meas4State);
 
     _firstix=_mbboWfWid;
+    _sizeTraces(_max_wf_length);
+    for (int i=0; i<NCHAN; i++) _traces[i].gen = -1;
 
     setStringParam(_siName, driverName);
     setIntegerParam(_loStore, 1);
@@ -117,11 +121,25 @@ void drvTek::updateUser(){
     asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s\n",
             driverName.c_str(), functionName.c_str());
 
-    getEnum(TrigSouCmnd, _mbboTrSou, trigSou);
-    getEnum(TrigSloCmnd, _boTrSlo, trigSlo);
-    getEnum(TrigStaCmnd, _mbbiTrSta, trigSta);
-    getEnum(TrigModeCmnd, _boTrMode, trgMode);
-    getInt(AcqStateCmnd, _biAcqStat);
+    batchEnum(TrigSouCmnd, _mbboTrSou, trigSou);
+    batchEnum(TrigSloCmnd, _boTrSlo, trigSlo);
+    batchEnum(TrigStaCmnd, _mbbiTrSta, trigSta);
+    batchEnum(TrigModeCmnd, _boTrMode, trgMode);
+    batchInt(AcqStateCmnd, _biAcqStat);
+}
+
+
+bool drvTek::_wfFormat(int nbyt, const char* enc, const char* bfmt, const char* bord, wfFormat_t* pf) {
+/*-----------------------------------------------------------------------------
+ * Fills in pf from the BYT_NR, ENCDG, BN_FMT and BYT_OR fields of a waveform
+ * preamble.  Returns false for ASCII or an unsupported width.
+ *---------------------------------------------------------------------------*/
+    if ((enc[0] != 'B') || ((nbyt != 1) && (nbyt != 2))) return false;
+
+    pf->width = nbyt;
+    pf->sgn = (strncmp(bfmt, "RP", 2) != 0);
+    pf->msb = (strncmp(bord, "LSB", 3) != 0);
+    return true;
 }
 
 
@@ -217,6 +235,29 @@ bool drvTek::isRunning() {
 }
 
 
+int drvTek::getAcqCount() {
+/*-----------------------------------------------------------------------------
+ * Returns the number of acquisitions since the last run, or -1 when it can
+ * not be read.
+ *---------------------------------------------------------------------------*/
+    char buf[32];
+
+    if (writeRd(AcqNumCmnd, buf, sizeof(buf)) != asynSuccess) return -1;
+    return atoi(buf);
+}
+
+
+bool drvTek::changesPreamble(int ix) {
+/*-----------------------------------------------------------------------------
+ * Adds the data width, channel scale, timebase and setup recall to the
+ * settings of the base class that change a waveform preamble.
+ *---------------------------------------------------------------------------*/
+    return drvScope::changesPreamble(ix) || (ix == _mbboWfWid) ||
+           (ix == _mbboChScl) || (ix == _mbboTimDivV) || (ix == _mbboTimDivU) ||
+           (ix == _loRecall);
+}
+
+
 const std::vector<std::string> drvTek::getKeywordList(int cix) const {
 /*-----------------------------------------------------------------------------
  * Overides the empty virtual function in the base class.  It returns a pointer
@@ -262,70 +303,225 @@ const char* drvTek::getCommand(int cix) {
 }
 
 
+void drvTek::_sizeTraces(int n) {
+/*-----------------------------------------------------------------------------
+ * Makes the trace buffers of all channels hold n points, but never less than
+ * _max_wf_length.  Buffers are only reallocated when the length changes.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "_sizeTraces";
+
+    n = MAX(n, _max_wf_length);
+    if (n == _traceLen) return;
+
+    asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: %d --> %d points\n",
+            driverName.c_str(), functionName.c_str(), _traceLen, n);
+
+    for (int i=0; i<NCHAN; i++) {
+        _traces[i].volts.resize(n);
+        _traces[i].scaled.resize(n);
+    }
+    _traceLen = n;
+}
+
+
 void drvTek::getWaveform(int ch) {
 /*-----------------------------------------------------------------------------
- * Requests waveform data for channel ch (0..3).  This gets waveform preamble
- * and waveform data.
+ * Requests waveform data for channel ch (0..3) and processes them in the
+ * calling thread.
  *---------------------------------------------------------------------------*/
-    const std::string functionName = "getWaveform";
+    if (fetchWaveform(ch)) {
+        procWaveform(ch);
+    }
+}
+
+
+bool drvTek::fetchWaveform(int ch) {
+/*-----------------------------------------------------------------------------
+ * Reads waveform preamble and data for channel ch (0..3) into the channel's
+ * trace buffer.  The preamble is only read when the cached one is stale.
+ * Returns true when there is a trace to publish, which for a channel that is
+ * off is the 'no data' trace.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "fetchWaveform";
     asynStatus stat = asynSuccess;
-    int chon = 0, preamble_len = 0, wf_len = 0, wf_len_act = 0, nbyte = 0, x0 = 0, np = 0;
-    double hs, pos, vdiv, ymult, yzr, yof;
-    char _rbuf[DBUF_LEN];
-    float _wfraw[_max_wf_length];
-    float* pwr = _wfraw;
-    float _wfbuf[_max_wf_length];
-    float* pwf = _wfbuf;
-    char* pb; 
-    short* pw; 
-    float ftmp; 
+    int chon = 0, preamble_len = 0, gen = 0;
+    char cmnd[64];
+    TraceBuf* ptr = &_traces[ch];
   
+    stageMark();
     getIntegerParam(ch, _boChOn, &chon);
-    if (chon) {
-        stat = writeRd(ixWfTrace, ch+1, _rbuf, DBUF_LEN);
+    ptr->on = chon;
+    if (!chon) return true;
+
+    // Preamble is still valid, read the curve only.
+    gen = preambleGen();
+    if (ptr->gen == gen) {
+        sprintf(cmnd, WfCurvCmnd, ch+1);
+        expectBlock(ptr->len*ptr->fmt.width);
+        stat = writeRdBlock(cmnd, _wfPre, ptr->blk);
         if (stat != asynSuccess) {
-            asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: ch=%d, stat=%d, rbuf=%s\n",
-                    driverName.c_str(), functionName.c_str(), ch, stat, _rbuf);
-            return;
+            asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: ch=%d, stat=%d\n",
+                    driverName.c_str(), functionName.c_str(), ch, stat);
+            return false;
         }
-        getDoubleParam(ch, _aoChPos, &pos);
-        getDoubleParam(ch, _aoChScl, &vdiv);
-        getDoubleParam(0, _aiTimDiv, &hs);
+        if ((int)ptr->blk.size() != ptr->len*ptr->fmt.width) ptr->gen = -1;
+        stageTime(enStXfer, ptr->len);
+        return true;
+    }
 
-        preamble_len = _parseWfPreamble(_rbuf, &wf_len_act, &nbyte, &ymult, &yzr, &yof);
-        if (preamble_len <= 0) {
-            asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: Invalid preamble length, preamble_len=%d\n",
-                    driverName.c_str(), functionName.c_str(), preamble_len);
-            return;
+    stat = writeRdBlock(ixWfTrace, ch+1, _wfPre, ptr->blk);
+    if (stat != asynSuccess) {
+        asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: ch=%d, stat=%d, pre=%s\n",
+                driverName.c_str(), functionName.c_str(), ch, stat, _wfPre.c_str());
+        return false;
+    }
+    stageTime(enStXfer);
+
+    // WAVF? returns preamble and data in one reply, so the preamble stage
+    // is the parse time and the transfer stage includes the preamble.
+    preamble_len = _parseWfPreamble(_wfPre.c_str(), &ptr->len, &ptr->fmt,
+            &ptr->ymult, &ptr->yzr, &ptr->yof);
+    if (preamble_len <= 0) {
+        asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: Invalid preamble length, preamble_len=%d\n",
+                driverName.c_str(), functionName.c_str(), preamble_len);
+        ptr->gen = -1;
+        desync();
+        return false;
+    }
+    ptr->gen = gen;
+    stageTime(enStPre, ptr->len);
+    stagePoints(enStXfer, ptr->len);
+    return true;
+}
+
+
+bool drvTek::fetchWaveforms(bool* ready) {
+/*-----------------------------------------------------------------------------
+ * Reads preambles and data of all channels that are on in one exchange: the
+ * channels are set as a source list, the preambles come back one after the
+ * other, followed by one block per channel.  When the cached preambles of
+ * all those channels are valid, only the curves are read.  Sets ready[ch]
+ * for the channels that have a trace to publish.  Returns false when the
+ * exchange fails or its preambles don't parse, e.g. the scope rejects the
+ * source list, so that the caller reads the channels one by one.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "fetchWaveforms";
+    asynStatus stat = asynSuccess;
+    std::vector<char>* blks[NCHAN];
+    int chs[NCHAN];
+    int chon = 0, non = 0, preamble_len = 0, npts = 0, gen = 0;
+    size_t nbytes = 0;
+    bool cached = true;
+    std::string src;
+    const char* pp;
+    char cmnd[64];
+
+    stageMark();
+    for (int ch=0; ch<NCHAN; ch++) {
+        getIntegerParam(ch, _boChOn, &chon);
+        _traces[ch].on = chon;
+        ready[ch] = !chon;
+        if (chon) {
+            sprintf(cmnd, "%sCH%d", non ? "," : "", ch+1);
+            src += cmnd;
+            blks[non] = &_traces[ch].blk;
+            chs[non++] = ch;
         }
+    }
+    if (!non) return true;
+
+    gen = preambleGen();
+    for (int i=0; i<non; i++) cached = cached && (_traces[chs[i]].gen == gen);
+    if (cached) {
+        for (int i=0; i<non; i++) nbytes += _traces[chs[i]].len*_traces[chs[i]].fmt.width;
+        expectBlock(nbytes);
+        sprintf(cmnd, WfCurvAllCmnd, src.c_str());
+        stat = writeRdBlocks(cmnd, _wfPre, blks, non);
+        if (stat != asynSuccess) {
+            asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: src=%s, stat=%d\n",
+                    driverName.c_str(), functionName.c_str(), src.c_str(), stat);
+            return false;
+        }
+        for (int i=0; i<non; i++) {
+            TraceBuf* ptr = &_traces[chs[i]];
+            if ((int)ptr->blk.size() != ptr->len*ptr->fmt.width) ptr->gen = -1;
+            ready[chs[i]] = true;
+            npts += ptr->len;
+        }
+        stageTime(enStXfer, npts);
+        return true;
+    }
 
-        if (vdiv < 0) vdiv = 1.0;
-        pb = (&_rbuf[preamble_len]);
-        pw = (short*)pb;
-        _get_hs_params(hs, &x0, &np);
-        wf_len = wf_len_act<_max_wf_length?wf_len_act:_max_wf_length;
-        wf_len = wf_len<0?0:wf_len;
-        for (int i=0, j=0; i<wf_len; i++,pb++,pw++) {
-            if (nbyte == 1) {
-                ftmp = (*pb);
-            } else {
-                ftmp = (*pw);
-            }
+    sprintf(cmnd, WfAllCmnd, src.c_str());
+    stat = writeRdBlocks(cmnd, _wfPre, blks, non);
+    if (stat != asynSuccess) {
+        asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: src=%s, stat=%d, pre=%s\n",
+                driverName.c_str(), functionName.c_str(), src.c_str(), stat, _wfPre.c_str());
+        return false;
+    }
+    stageTime(enStXfer);
 
-            if ((i >= x0) && (j <= np)) {
-                *pwr = (ftmp - yof)*ymult + yzr;
-                *pwf = ((ftmp - yof)*ymult + yzr)/vdiv + pos;
-                pwf++; 
-                pwr++;
-                j++;
+    pp = _wfPre.c_str();
+    for (int i=0; i<non; i++) {
+        TraceBuf* ptr = &_traces[chs[i]];
+        preamble_len = _parseWfPreamble(pp, &ptr->len, &ptr->fmt, &ptr->ymult, &ptr->yzr, &ptr->yof);
+        if (preamble_len <= 0) {
+            asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: Invalid preamble length, ch=%d, preamble_len=%d\n",
+                    driverName.c_str(), functionName.c_str(), chs[i], preamble_len);
+            for (int k=0; k<non; k++) {
+                _traces[chs[k]].gen = -1;
+                ready[chs[k]] = false;
             }
+            desync();
+            return false;
         }
+        ptr->gen = gen;
+        pp += preamble_len;
+        ready[chs[i]] = true;
+        npts += ptr->len;
+    }
+    stageTime(enStPre, npts);
+    stagePoints(enStXfer, npts);
+    return true;
+}
+
+
+void drvTek::procWaveform(int ch) {
+/*-----------------------------------------------------------------------------
+ * Decodes the data fetched for channel ch (0..3) into the channel's trace
+ * buffers, which are sized from the record length (HOR:RECORDL), does the
+ * integration and publishes the trace.
+ *---------------------------------------------------------------------------*/
+    const std::string functionName = "procWaveform";
+    int wf_len = 0, x0 = 0, np = 0, rl = 0, n = 0;
+    double hs, pos, vdiv;
+    TraceBuf* ptr = &_traces[ch];
+    wfScale_t sc;
+
+    stageMark();
+    if (ptr->on) {
+        getDoubleParam(ch, _aoChPos, &pos);
+        getDoubleParam(ch, _aoChScl, &vdiv);
+        getDoubleParam(0, _aiTimDiv, &hs);
+        getIntegerParam(0, _loWfNpts, &rl);
+        _sizeTraces(MAX(rl, ptr->len));
+
+        if (vdiv < 0) vdiv = 1.0;
+        _get_hs_params(hs, &x0, &np);
+        x0 = MAX(x0, 0);
+        wf_len = MIN(ptr->len, (int)(ptr->blk.size()/ptr->fmt.width));
+        wf_len = MIN(wf_len, _traceLen);
+        n = MAX(0, MIN(np+1, wf_len - x0));
+        wfScaleTek(&sc, ptr->ymult, ptr->yzr, ptr->yof, vdiv, pos);
+        wfConvertBlock(ptr->blk.data() + x0*ptr->fmt.width, n, &ptr->fmt, &sc,
+                ptr->volts.data(), ptr->scaled.data());
+        stageTime(enStDecode, wf_len);
 
         // Waveform integration, units are V*s
         if (_analize[ch]) {
             _area[ch] = 0.0;
-            for (int i=_mix1[ch]; i<=_mix2[ch]; i++) {
-                _area[ch] += _wfraw[i]*hs*(10./wf_len);
+            for (int i=MAX(_mix1[ch], 0); i<=MIN(_mix2[ch], n-1); i++) {
+                _area[ch] += ptr->volts[i]*hs*(10./wf_len);
             }
             if (_doPeds[ch]) {
                 _doPeds[ch] = 0;
@@ -340,12 +536,13 @@ void drvTek::getWaveform(int ch) {
     } else {
         asynPrint(pasynUser, ASYN_TRACE_FLOW, "%s::%s: ch=%d not on\n",
                 driverName.c_str(), functionName.c_str(), ch);
-        for (int i=0; i<_max_wf_length; i++,pwf++) {
-            *pwf = 1000.0;
-        }
+        n = _max_wf_length;
+        std::fill(ptr->scaled.begin(), ptr->scaled.begin() + n, 1000.0);
     }
     
-    doCallbacksFloat32Array(_wfbuf, _max_wf_length, _wfTrace, ch);
+    stageMark();
+    doCallbacksFloat32Array(ptr->scaled.data(), n, _wfTrace, ch);
+    stageTime(enStCallback, n);
 }
 
 
@@ -383,7 +580,7 @@ void drvTek::getChanScl(int ch) {
 /*-----------------------------------------------------------------------------
  * Re-implemntation of a virtual function in base class.
  *---------------------------------------------------------------------------*/
-    getEnum(ChSclCmnd, _mbboChScl, chanScl, ch);
+    batchEnum(ChSclCmnd, _mbboChScl, chanScl, ch);
 }
 
 
@@ -686,7 +883,8 @@ asynStatus drvTek::putIntCmnds(int ix, int addr, int v) {
                             _setTimePerDiv(jx,v);
                             break;
   
-        case ixMbboWfWid:   setInt(jx, WfDatCmnd, v, ix);
+        case ixMbboWfWid:   setInt(jx, WfWidCmnd, v);
+                            setIntegerParam(ix, v);
                             break;
 
         case ixBoTrMode:    setEnum(TrigModeCmnd, v, trgMode);
@@ -813,10 +1011,6 @@ asynStatus drvTek::writeInt32(asynUser* pau, epicsInt32 v) {
             driverName.c_str(), functionName.c_str(), jx, addr, v);
 
     switch (jx) {
-        case ixMbboWfWid:
-            setInt(jx, WfWidCmnd, v, jx);
-            stat = setIntegerParam(jx, v);
-            break;
         default:
             stat = drvScope::writeInt32(pau,v);
             break;
@@ -6,7 +6,17 @@
  * asynPortDriver --> drvScope --> drvTek
  *---------------------------------------------------------------------------*/
 
+#include <epicsEndian.h>
+
 #include "drvScope.h"
+#include "wfConvert.h"
+
+// Binary data encoding in host byte order, cheapest to decode
+#if EPICS_BYTE_ORDER == EPICS_ENDIAN_BIG
+#define TEK_NATIVE_ENC  "RIB"
+#else
+#define TEK_NATIVE_ENC  "SRI"
+#endif
 
 #define mbboWfWidStr    "MBBO_WFWIDTH"  // bytes per point (1 or 2)
 #define boTrModeStr     "BO_TRMODE"     // trigger mode
@@ -52,6 +62,21 @@
 //    std::vector<std::string> keywords;
 //};
 
+// Per-channel trace buffers, allocated once and resized only when the
+// record length changes.  fetchWaveform() fills in blk and the preamble
+// values, procWaveform() decodes them into volts and scaled.  The preamble
+// values are reused while gen equals drvScope::preambleGen().
+struct TraceBuf {
+    std::vector<char>  blk;     // binary block as read from the scope
+    std::vector<float> volts;   // trace in volts
+    std::vector<float> scaled;  // trace in divisions, offset by position
+    bool       on;              // channel was on when fetched
+    int        len;             // points in the record, from the preamble
+    wfFormat_t fmt;             // block data format, from the preamble
+    double     ymult, yzr, yof; // vertical scale, from the preamble
+    int        gen;             // preamble generation, -1 when not cached
+};
+
 struct HorScale {
     int nanos;
     int start;
@@ -68,11 +93,16 @@ public:
     virtual asynStatus writeFloat64(asynUser* pau,epicsFloat64 v);
     virtual void afterInit();
     virtual void getWaveform(int ch);
+    virtual bool fetchWaveform(int ch);
+    virtual void procWaveform(int ch);
+    virtual bool fetchWaveforms(bool* ready);
     virtual const char* getCommand(int cix);
     virtual const std::vector<std::string> getKeywordList(int cix) const;
     virtual void getHSParams(double hs, int* x0, int* np);
     virtual bool isTriggered();
     virtual bool isRunning();
+    virtual int getAcqCount();
+    virtual bool changesPreamble(int ix);
 
 protected:
     int _mbboWfWid,     _boTrMode,      _mbboTrSou,     _boTrSlo,     _mbbiTrSta,
@@ -104,8 +134,12 @@ protected:
     virtual void getTrigLevl();
     virtual void setTrigLevl(int v);
     virtual void updateUser();
+    virtual bool canBatch() {return true;}
+    virtual bool canSnapshot() {return true;}
+    virtual bool isAction(int ix) {return (ix == _loRecall) || (ix == _loStore) || drvScope::isAction(ix);}
     virtual void getMeasurements(int pollCount);
-    virtual int _parseWfPreamble(const char* buf, int*, int*, double*, double*, double*) = 0;
+    virtual int _parseWfPreamble(const char* buf, int*, wfFormat_t*, double*, double*, double*) = 0;
+    bool _wfFormat(int nbyt, const char* enc, const char* bfmt, const char* bord, wfFormat_t* pf);
 
     // List of commands and corresponding keywords lists that we implement.
     // The order must agree with the order of enumerated names defined in the drvScope.h header file,
@@ -125,6 +159,9 @@ protected:
     const char* ChCplCmnd;
     const char* ChSclCmnd;
     const char* WfDatCmnd;
+    const char* WfAllCmnd;      // preambles and curves of a list of sources
+    const char* WfCurvCmnd;     // curve only, preamble cached
+    const char* WfCurvAllCmnd;  // curves only of a list of sources
     const char* WfNptCmnd;
     const char* WfWidCmnd;
     const char* WfStrtCmnd;
@@ -141,6 +178,7 @@ protected:
     const char* TrigSloCmnd;
     const char* AcqStateCmnd;
     const char* TrigStaCmnd;
+    const char* AcqNumCmnd;
     const char* RunCmnd;
     const char* StopCmnd;
     const char* EseCmnd;
@@ -182,7 +220,11 @@ private:
     asynStatus _get_trig_state();
     void      _get_hs_params(double hs, int* x0, int* np);
     void      _setTimePerDiv(uint vix, uint uix);
+    void      _sizeTraces(int n);
     int       _firstix;
+    std::string _wfPre;         // waveform preamble text
+    TraceBuf  _traces[NCHAN];   // trace buffers, one per channel
+    int       _traceLen;        // points allocated in each trace buffer
     const int _max_wf_length;
     const int _num_meas;
     const int _trigd_enum_val;  // Enum val for the TRIGGERed state
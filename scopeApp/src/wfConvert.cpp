@@ -0,0 +1,331 @@
+/* wfConvert.cpp
+ * Conversion of raw waveform samples to floating point traces, see
+ * wfConvert.h.  The SIMD kernels handle blocks of 16 (SSE2) or 8 (AVX2)
+ * samples, the scalar kernel handles the remainder.
+ *---------------------------------------------------------------------------*/
+
+#include <stdint.h>
+
+#include <epicsEndian.h>
+
+#include "wfConvert.h"
+
+// SSE2 is used when the compiler targets it (always on x86_64, with -msse2
+// on i386).  AVX2 is picked at run time, which needs the target attribute and
+// the AVX2 intrinsics outside -mavx2, from GCC 4.9.
+#if !defined(WF_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__)
+#define WF_X86
+#include <emmintrin.h>
+#if defined(__clang__) || (__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9))
+#define WF_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+namespace {
+
+const int WF_CHUNK = 512;    // 16 bit samples per byte order conversion
+
+enum {enKScalar, enKSSE2, enKAVX2};
+
+const char* kernelNames[] = {"scalar", "SSE2", "AVX2"};
+
+int kernel() {
+/*-----------------------------------------------------------------------------
+ * Returns the best kernel supported by the CPU.
+ *---------------------------------------------------------------------------*/
+    static int k = -1;
+
+    if (k < 0) {
+#if defined(WF_AVX2)
+        __builtin_cpu_init();
+        k = __builtin_cpu_supports("avx2") ? enKAVX2 : enKSSE2;
+#elif defined(WF_X86)
+        k = enKSSE2;
+#else
+        k = enKScalar;
+#endif
+    }
+    return k;
+}
+
+
+template <typename T>
+void convertScalar(const T* raw, int n, const wfScale_t* ps, float* volts, float* scaled) {
+/*---------------------------------------------------------------------------*/
+    for (int i=0; i<n; i++) {
+        float v = raw[i]*ps->a + ps->b;
+        volts[i] = v;
+        scaled[i] = v*ps->c + ps->d;
+    }
+}
+
+
+#ifdef WF_X86
+inline void store4(__m128i x, const __m128* k, float* volts, float* scaled) {
+/*-----------------------------------------------------------------------------
+ * Scales 4 samples held as 32 bit integers in x and stores the results.
+ *---------------------------------------------------------------------------*/
+    __m128 v = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(x), k[0]), k[1]);
+    _mm_storeu_ps(volts, v);
+    _mm_storeu_ps(scaled, _mm_add_ps(_mm_mul_ps(v, k[2]), k[3]));
+}
+
+
+template <bool SIGNED>
+int convert8SSE2(const char* raw, int n, const wfScale_t* ps, float* volts, float* scaled) {
+/*-----------------------------------------------------------------------------
+ * Converts 16 samples per iteration, returns the number converted.
+ *---------------------------------------------------------------------------*/
+    const __m128 k[4] = {_mm_set1_ps(ps->a), _mm_set1_ps(ps->b),
+                         _mm_set1_ps(ps->c), _mm_set1_ps(ps->d)};
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+
+    for (; i+16<=n; i+=16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(raw + i));
+        __m128i lo, hi;
+        if (SIGNED) {
+            lo = _mm_srai_epi16(_mm_unpacklo_epi8(x, x), 8);
+            hi = _mm_srai_epi16(_mm_unpackhi_epi8(x, x), 8);
+            store4(_mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16), k, volts+i, scaled+i);
+            store4(_mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16), k, volts+i+4, scaled+i+4);
+            store4(_mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16), k, volts+i+8, scaled+i+8);
+            store4(_mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16), k, volts+i+12, scaled+i+12);
+        } else {
+            lo = _mm_unpacklo_epi8(x, zero);
+            hi = _mm_unpackhi_epi8(x, zero);
+            store4(_mm_unpacklo_epi16(lo, zero), k, volts+i, scaled+i);
+            store4(_mm_unpackhi_epi16(lo, zero), k, volts+i+4, scaled+i+4);
+            store4(_mm_unpacklo_epi16(hi, zero), k, volts+i+8, scaled+i+8);
+            store4(_mm_unpackhi_epi16(hi, zero), k, volts+i+12, scaled+i+12);
+        }
+    }
+    return i;
+}
+
+
+template <bool SIGNED>
+int convert16SSE2(const char* raw, int n, const wfScale_t* ps, float* volts, float* scaled) {
+/*-----------------------------------------------------------------------------
+ * Converts 8 samples per iteration, returns the number converted.
+ *---------------------------------------------------------------------------*/
+    const __m128 k[4] = {_mm_set1_ps(ps->a), _mm_set1_ps(ps->b),
+                         _mm_set1_ps(ps->c), _mm_set1_ps(ps->d)};
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+
+    for (; i+8<=n; i+=8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(raw + 2*i));
+        if (SIGNED) {
+            store4(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16), k, volts+i, scaled+i);
+            store4(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16), k, volts+i+4, scaled+i+4);
+        } else {
+            store4(_mm_unpacklo_epi16(x, zero), k, volts+i, scaled+i);
+            store4(_mm_unpackhi_epi16(x, zero), k, volts+i+4, scaled+i+4);
+        }
+    }
+    return i;
+}
+
+
+#ifdef WF_AVX2
+__attribute__((target("avx2")))
+inline void store8(__m256i x, const __m256* k, float* volts, float* scaled) {
+/*-----------------------------------------------------------------------------
+ * Scales 8 samples held as 32 bit integers in x and stores the results.
+ *---------------------------------------------------------------------------*/
+    __m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(x), k[0]), k[1]);
+    _mm256_storeu_ps(volts, v);
+    _mm256_storeu_ps(scaled, _mm256_add_ps(_mm256_mul_ps(v, k[2]), k[3]));
+}
+
+
+__attribute__((target("avx2")))
+int convert8AVX2(bool sgn, const char* raw, int n, const wfScale_t* ps, float* volts, float* scaled) {
+/*-----------------------------------------------------------------------------
+ * Converts 8 samples per iteration, returns the number converted.
+ *---------------------------------------------------------------------------*/
+    const __m256 k[4] = {_mm256_set1_ps(ps->a), _mm256_set1_ps(ps->b),
+                         _mm256_set1_ps(ps->c), _mm256_set1_ps(ps->d)};
+    int i = 0;
+
+    for (; i+8<=n; i+=8) {
+        __m128i x = _mm_loadl_epi64((const __m128i*)(raw + i));
+        store8(sgn ? _mm256_cvtepi8_epi32(x) : _mm256_cvtepu8_epi32(x), k, volts+i, scaled+i);
+    }
+    return i;
+}
+
+
+__attribute__((target("avx2")))
+int convert16AVX2(bool sgn, const char* raw, int n, const wfScale_t* ps, float* volts, float* scaled) {
+/*-----------------------------------------------------------------------------
+ * Converts 8 samples per iteration, returns the number converted.
+ *---------------------------------------------------------------------------*/
+    const __m256 k[4] = {_mm256_set1_ps(ps->a), _mm256_set1_ps(ps->b),
+                         _mm256_set1_ps(ps->c), _mm256_set1_ps(ps->d)};
+    int i = 0;
+
+    for (; i+8<=n; i+=8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(raw + 2*i));
+        store8(sgn ? _mm256_cvtepi16_epi32(x) : _mm256_cvtepu16_epi32(x), k, volts+i, scaled+i);
+    }
+    return i;
+}
+#endif    // WF_AVX2
+#endif    // WF_X86
+
+}    // End anonymous namespace
+
+
+void wfScaleTek(wfScale_t* ps, double ymult, double yzr, double yof, double vdiv, double pos) {
+/*-----------------------------------------------------------------------------
+ * Coefficients for Tektronix data: volts = (raw - yof)*ymult + yzr, and
+ * scaled = volts/vdiv + pos.
+ *---------------------------------------------------------------------------*/
+    ps->a = ymult;
+    ps->b = yzr - yof*ymult;
+    ps->c = (vdiv != 0.0) ? 1.0/vdiv : 1.0;
+    ps->d = pos;
+}
+
+
+void wfScaleRigol(wfScale_t* ps, double yinc, double yorg, double yref, double vdiv, double pos) {
+/*-----------------------------------------------------------------------------
+ * Coefficients for Rigol data: volts = (raw - yorg - yref)*yinc, and
+ * scaled = volts/vdiv + pos.
+ *---------------------------------------------------------------------------*/
+    ps->a = yinc;
+    ps->b = -(yorg + yref)*yinc;
+    ps->c = (vdiv != 0.0) ? 1.0/vdiv : 1.0;
+    ps->d = pos;
+}
+
+
+void wfConvertS8(const signed char* raw, int n, const wfScale_t* ps, float* volts, float* scaled) {
+/*---------------------------------------------------------------------------*/
+    int i = 0;
+#ifdef WF_X86
+    switch (kernel()) {
+#ifdef WF_AVX2
+        case enKAVX2: i = convert8AVX2(true, (const char*)raw, n, ps, volts, scaled); break;
+#endif
+        case enKSSE2: i = convert8SSE2<true>((const char*)raw, n, ps, volts, scaled); break;
+    }
+#endif
+    convertScalar(raw + i, n - i, ps, volts + i, scaled + i);
+}
+
+
+void wfConvertU8(const unsigned char* raw, int n, const wfScale_t* ps, float* volts, float* scaled) {
+/*---------------------------------------------------------------------------*/
+    int i = 0;
+#ifdef WF_X86
+    switch (kernel()) {
+#ifdef WF_AVX2
+        case enKAVX2: i = convert8AVX2(false, (const char*)raw, n, ps, volts, scaled); break;
+#endif
+        case enKSSE2: i = convert8SSE2<false>((const char*)raw, n, ps, volts, scaled); break;
+    }
+#endif
+    convertScalar(raw + i, n - i, ps, volts + i, scaled + i);
+}
+
+
+void wfConvertS16(const short* raw, int n, const wfScale_t* ps, float* volts, float* scaled) {
+/*---------------------------------------------------------------------------*/
+    int i = 0;
+#ifdef WF_X86
+    switch (kernel()) {
+#ifdef WF_AVX2
+        case enKAVX2: i = convert16AVX2(true, (const char*)raw, n, ps, volts, scaled); break;
+#endif
+        case enKSSE2: i = convert16SSE2<true>((const char*)raw, n, ps, volts, scaled); break;
+    }
+#endif
+    convertScalar(raw + i, n - i, ps, volts + i, scaled + i);
+}
+
+
+void wfConvertU16(const unsigned short* raw, int n, const wfScale_t* ps, float* volts, float* scaled) {
+/*---------------------------------------------------------------------------*/
+    int i = 0;
+#ifdef WF_X86
+    switch (kernel()) {
+#ifdef WF_AVX2
+        case enKAVX2: i = convert16AVX2(false, (const char*)raw, n, ps, volts, scaled); break;
+#endif
+        case enKSSE2: i = convert16SSE2<false>((const char*)raw, n, ps, volts, scaled); break;
+    }
+#endif
+    convertScalar(raw + i, n - i, ps, volts + i, scaled + i);
+}
+
+
+bool wfHostMsb() {
+/*-----------------------------------------------------------------------------
+ * Returns true when the host stores the most significant byte first.
+ *---------------------------------------------------------------------------*/
+    return EPICS_BYTE_ORDER == EPICS_ENDIAN_BIG;
+}
+
+
+int wfConvertBlock(const char* raw, int n, const wfFormat_t* pf, const wfScale_t* ps,
+        float* volts, float* scaled) {
+/*-----------------------------------------------------------------------------
+ * Decodes n points of binary block data in raw, formatted as described by pf.
+ * 16 bit data in host byte order on an even address are converted in place,
+ * others are assembled into host order samples in chunks of WF_CHUNK points
+ * first.  Returns the number of points converted, or -1 for an unsupported
+ * format.
+ *---------------------------------------------------------------------------*/
+    unsigned short tmp[WF_CHUNK];
+    const unsigned char* pb = (const unsigned char*)raw;
+
+    if (n <= 0) return 0;
+
+    if (pf->width == 1) {
+        if (pf->sgn) {
+            wfConvertS8((const signed char*)raw, n, ps, volts, scaled);
+        } else {
+            wfConvertU8(pb, n, ps, volts, scaled);
+        }
+        return n;
+    }
+
+    if (pf->width != 2) return -1;
+
+    if ((pf->msb == wfHostMsb()) && !((uintptr_t)raw & 1)) {
+        if (pf->sgn) {
+            wfConvertS16((const short*)raw, n, ps, volts, scaled);
+        } else {
+            wfConvertU16((const unsigned short*)raw, n, ps, volts, scaled);
+        }
+        return n;
+    }
+
+    for (int i=0; i<n; i+=WF_CHUNK) {
+        int m = (n - i < WF_CHUNK) ? n - i : WF_CHUNK;
+        const unsigned char* p = pb + 2*i;
+        if (pf->msb) {
+            for (int k=0; k<m; k++, p+=2) tmp[k] = (p[0] << 8) | p[1];
+        } else {
+            for (int k=0; k<m; k++, p+=2) tmp[k] = p[0] | (p[1] << 8);
+        }
+        if (pf->sgn) {
+            wfConvertS16((const short*)tmp, m, ps, volts + i, scaled + i);
+        } else {
+            wfConvertU16(tmp, m, ps, volts + i, scaled + i);
+        }
+    }
+    return n;
+}
+
+
+const char* wfConvertKernel() {
+/*-----------------------------------------------------------------------------
+ * Returns the name of the kernel in use.
+ *---------------------------------------------------------------------------*/
+    return kernelNames[kernel()];
+}
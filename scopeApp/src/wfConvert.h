@@ -0,0 +1,43 @@
+#ifndef WFCONVERT_H
+#define WFCONVERT_H
+
+/* wfConvert.h
+ * Conversion of raw waveform samples to floating point traces.  Each kernel
+ * makes one pass over the raw data and writes two arrays:
+ *   volts[i]  = raw[i]*a + b
+ *   scaled[i] = volts[i]*c + d
+ * The coefficients are set up from the scope's preamble with wfScaleTek() or
+ * wfScaleRigol().  On x86 the kernels use AVX2 when the CPU supports it and
+ * SSE2 otherwise; elsewhere, or when built with -DWF_NO_SIMD, plain C.  SSE2
+ * needs a compiler targeting it (-msse2 on i386), AVX2 needs GCC 4.9.
+ * wfConvertBlock() decodes a binary block of any width, signedness and byte
+ * order as given by a wfFormat_t, reading 16 bit data through aligned, host
+ * order samples.
+ *---------------------------------------------------------------------------*/
+
+typedef struct {
+    float a, b;         // raw --> volts
+    float c, d;         // volts --> scaled
+} wfScale_t;
+
+typedef struct {
+    int  width;         // bytes per point, 1 or 2
+    bool sgn;           // signed (RI) or positive (RP) integers
+    bool msb;           // most significant byte first
+} wfFormat_t;
+
+void wfScaleTek(wfScale_t* ps, double ymult, double yzr, double yof, double vdiv, double pos);
+void wfScaleRigol(wfScale_t* ps, double yinc, double yorg, double yref, double vdiv, double pos);
+
+void wfConvertS8(const signed char* raw, int n, const wfScale_t* ps, float* volts, float* scaled);
+void wfConvertU8(const unsigned char* raw, int n, const wfScale_t* ps, float* volts, float* scaled);
+void wfConvertS16(const short* raw, int n, const wfScale_t* ps, float* volts, float* scaled);
+void wfConvertU16(const unsigned short* raw, int n, const wfScale_t* ps, float* volts, float* scaled);
+
+int  wfConvertBlock(const char* raw, int n, const wfFormat_t* pf, const wfScale_t* ps,
+        float* volts, float* scaled);
+bool wfHostMsb();
+
+const char* wfConvertKernel();
+
+#endif    // WFCONVERT_H